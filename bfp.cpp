@@ -1,209 +1,2442 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
 #include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef BFP_API4
+// API v4 build (-DBFP_API4), VapourSynth4.h comes from the VapourSynth SDK
+// (R55 or later). The v3 names below only map onto v4 calls and constants
+// whose arguments didn't change, everything else is ported where it's used.
+#include <VapourSynth4.h>
+
+typedef VSFrame VSFrameRef;
+typedef VSNode VSNodeRef;
+typedef VSVideoFormat VSFormat;
+
+#define propGetInt mapGetInt
+#define propGetFloat mapGetFloat
+#define propGetData mapGetData
+#define propGetNode mapGetNode
+#define propGetFrame mapGetFrame
+#define propNumElements mapNumElements
+#define propSetInt mapSetInt
+#define propSetFloat mapSetFloat
+#define propSetIntArray mapSetIntArray
+#define propSetFloatArray mapSetFloatArray
+#define propSetNode mapSetNode
+#define propSetFrame mapSetFrame
+#define getFramePropsRO getFramePropertiesRO
+#define getFramePropsRW getFramePropertiesRW
+#define getFrameFormat getVideoFrameFormat
+#define getPluginById getPluginByID
+#define getError mapGetError
+#define setError mapSetError
+#define paReplace maReplace
+#define paAppend maAppend
+#define cmRGB cfRGB
+
+// VSHelper.h is v3 only
+static inline int int64ToIntS(int64_t i) {
+    return static_cast<int>(std::min<int64_t>(std::max<int64_t>(i, INT_MIN), INT_MAX));
+}
+
+static inline void *vs_aligned_malloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void *p;
+    return posix_memalign(&p, alignment, size) ? nullptr : p;
+#endif
+}
+
+static inline void vs_aligned_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static inline bool isConstantFormat(const VSVideoInfo *vi) {
+    return vi->format.colorFamily != cfUndefined && vi->width > 0 && vi->height > 0;
+}
+
+static inline void vs_bitblt(void *dstp, ptrdiff_t dstStride, const void *srcp, ptrdiff_t srcStride, size_t rowSize, size_t height) {
+    for (size_t y = 0; y < height; y++)
+        memcpy(static_cast<uint8_t *>(dstp) + dstStride * y, static_cast<const uint8_t *>(srcp) + srcStride * y, rowSize);
+}
+
+#define CLIP_ARG "vnode"
+#else
 #include "VapourSynth.h"
 #include "VSHelper.h"
 
+#define CLIP_ARG "clip"
+#endif
+
+#include "score.h"
+
 #define MAX_VIDEO_INPUT 32
+#define FINGERPRINT_SIZE 16
+#define MAX_OUTPUTS MAX_VIDEO_INPUT // Rank has up to one output per clip
+#define MAX_PLANES 4 // colour planes and the _Alpha frame
+#define MAX_PICKS (2 * MAX_PLANES) // a top and a bottom field per plane
+#define TELEMETRY_BUCKETS 24
+#define LOG_RING_SIZE 1024
+#define LOG_REORDER_LIMIT 4096
+#define MAX_CASCADE 4
+#define SCRATCH_SHARDS 64
+#define SCRATCH_CLASSES 32
+#define TEMPORAL_CACHE_SIZE 32
 
-int findMinIndex (int arr[])
+static int findMinIndex(const double arr[], int size)
 {
-    int min, i, arr_size;
-    arr_size = sizeof(arr) / sizeof(arr[0]);
-    min = arr[0];
-    for (i = 0; i < arr_size; i++) {
-        if (arr[i] < min)
-            min = arr[i];
+    int index = 0;
+    for (int i = 1; i < size; i++) {
+        if (arr[i] < arr[index])
+            index = i;
     };
-    return min;
+    return index;
 };
 
-int findMaxIndex (int arr[])
+static int findMaxIndex(const double arr[], int size)
 {
-    int max, i, arr_size;
-    arr_size = sizeof(arr) / sizeof(arr[0]);
-    max = arr[0];
-    for (i = 0; i < arr_size; i++) {
-        if (max < arr[i])
-            max = arr[i];
+    int index = 0;
+    for (int i = 1; i < size; i++) {
+        if (arr[index] < arr[i])
+            index = i;
     };
-    return max;
+    return index;
+};
+
+// The format of a clip, v4 embeds it in the video info.
+static const VSFormat *videoFormat(const VSVideoInfo *vi) {
+#ifdef BFP_API4
+    return &vi->format;
+#else
+    return vi->format;
+#endif
+};
+
+// v3 has one VSFormat per format, v4 ones are compared field by field.
+static bool sameFormat(const VSVideoInfo *a, const VSVideoInfo *b) {
+#ifdef BFP_API4
+    return a->format.colorFamily == b->format.colorFamily
+        && a->format.sampleType == b->format.sampleType
+        && a->format.bitsPerSample == b->format.bitsPerSample
+        && a->format.subSamplingW == b->format.subSamplingW
+        && a->format.subSamplingH == b->format.subSamplingH;
+#else
+    return a->format == b->format;
+#endif
+};
+
+static int formatId(const VSVideoInfo *vi, VSCore *core, const VSAPI *vsapi) {
+#ifdef BFP_API4
+    return vsapi->queryVideoFormatID(vi->format.colorFamily, vi->format.sampleType, vi->format.bitsPerSample,
+        vi->format.subSamplingW, vi->format.subSamplingH, core);
+#else
+    return vi->format->id;
+#endif
+};
+
+static void logWarning(const std::string &msg, VSCore *core, const VSAPI *vsapi) {
+#ifdef BFP_API4
+    vsapi->logMessage(mtWarning, msg.c_str(), core);
+#else
+    vsapi->logMessage(mtWarning, msg.c_str());
+#endif
 };
 
 namespace {
+    // Score files
+    //
+    // A shard ("BFPS") is written by one process and holds the records of
+    // every frame that process produced, in frame order. MergeScores folds
+    // any number of shards into an index ("BFPI") that holds one record per
+    // frame of the clip, so a record can be found with a single seek.
+    // Missing frames in an index have their frame number set to -1.
+    typedef struct {
+        char magic[4];
+        uint32_t version;
+        int32_t numInputs;
+        int32_t width;
+        int32_t height;
+        int32_t numFrames;
+        int32_t numRecords;
+        int32_t reserved;
+    } ScoreFileHeader;
+
+    typedef struct {
+        int32_t frame;
+        int32_t best;
+        // followed by numInputs doubles
+    } ScoreRecord;
+
+    // Fingerprint cache ("BFPA"), the header is followed by one
+    // FINGERPRINT_SIZE x FINGERPRINT_SIZE 8 bit luma thumbnail per frame
+    // and clip, clip after clip. contentKey[i] hashes a few frames of clip
+    // i, so another encode with the same length doesn't match.
+    typedef struct {
+        char magic[4];
+        uint32_t version;
+        int32_t numInputs;
+        int32_t numFrames; // fingerprinted frames per clip
+        int32_t clipFrames[MAX_VIDEO_INPUT];
+        int32_t clipWidth[MAX_VIDEO_INPUT];
+        int32_t clipHeight[MAX_VIDEO_INPUT];
+        uint64_t contentKey[MAX_VIDEO_INPUT];
+    } FingerprintHeader;
+
+    const char scoreShardMagic[4] = {'B', 'F', 'P', 'S'};
+    const char scoreIndexMagic[4] = {'B', 'F', 'P', 'I'};
+    const uint32_t scoreFileVersion = 1;
+    const char fingerprintMagic[4] = {'B', 'F', 'P', 'A'};
+    const uint32_t fingerprintVersion = 2;
+    const int fingerprintBytes = FINGERPRINT_SIZE * FINGERPRINT_SIZE;
+
+    // Read-only view of a whole file, mapped into memory
+    class MappedFile {
+    public:
+        MappedFile(const std::string &path) : data(nullptr), size(0) {
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return;
+            LARGE_INTEGER fileSize;
+            if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+                HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mapping) {
+                    data = reinterpret_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                    if (data)
+                        size = static_cast<size_t>(fileSize.QuadPart);
+                    CloseHandle(mapping);
+                }
+            }
+            CloseHandle(file);
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (!fstat(fd, &st) && st.st_size > 0) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = reinterpret_cast<const uint8_t *>(p);
+                    size = st.st_size;
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~MappedFile() {
+            if (!data)
+                return;
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+#else
+            munmap(const_cast<uint8_t *>(data), size);
+#endif
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const uint8_t *data;
+        size_t size;
+    };
+
+    // Decision log ("BFPL"), the header is followed by one record per frame:
+    // int32 frame, int32 best[numPlanes], double scores[numPlanes][numInputs].
+    typedef struct {
+        char magic[4];
+        uint32_t version;
+        int32_t numInputs;
+        int32_t numPlanes;
+    } LogFileHeader;
+
+    const char logMagic[4] = {'B', 'F', 'P', 'L'};
+    const uint32_t logVersion = 1;
+
+    typedef struct {
+        int32_t frame;
+        int32_t best[MAX_PICKS];
+        double scores[MAX_PICKS][MAX_VIDEO_INPUT];
+    } LogEntry;
+
+    // Writes decisions to a CSV or binary log from a background thread.
+    // Frame threads push into a bounded lock-free ring (one sequence number
+    // per cell, producers claim cells with a CAS), the writer drains it and
+    // holds frames that arrive early until the ones before them are written.
+    // Frames that never arrive stall the output for at most
+    // LOG_REORDER_LIMIT entries.
+    class ScoreLog {
+    public:
+        ScoreLog(const std::string &path, bool csv, int numInputs, int numPlanes, const char *function, VSCore *core, const VSAPI *vsapi)
+            : path(path), csv(csv), numInputs(numInputs), numPlanes(numPlanes), function(function), core(core), vsapi(vsapi),
+              cells(new Cell[LOG_RING_SIZE]), tail(0), head(0), stopping(false), next(0), failed(false) {
+            f = fopen(path.c_str(), csv ? "w" : "wb");
+            if (!f)
+                throw std::runtime_error("unable to create log " + path + ".");
+            for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            writeHeader();
+            writer = std::thread([this] { drain(); });
+        }
+
+        ~ScoreLog() {
+            stopping.store(true, std::memory_order_release);
+            writer.join();
+            failed = fclose(f) || failed;
+            if (failed)
+                logWarning(std::string(function) + ": unable to write log " + path + ".", core, vsapi);
+        }
+
+        ScoreLog(const ScoreLog &) = delete;
+        ScoreLog &operator=(const ScoreLog &) = delete;
+
+        // Called from any frame thread, only waits when the writer is
+        // LOG_RING_SIZE entries behind.
+        void push(const LogEntry &entry) {
+            uint64_t pos = tail.load(std::memory_order_relaxed);
+            Cell *cell;
+            for (;;) {
+                cell = &cells[pos % LOG_RING_SIZE];
+                int64_t lag = static_cast<int64_t>(cell->seq.load(std::memory_order_acquire) - pos);
+                if (lag == 0 && tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+                if (lag < 0) {
+                    std::this_thread::yield();
+                    pos = tail.load(std::memory_order_relaxed);
+                } else if (lag > 0) {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+            cell->entry = entry;
+            cell->seq.store(pos + 1, std::memory_order_release);
+        }
+
+    private:
+        typedef struct {
+            std::atomic<uint64_t> seq;
+            LogEntry entry;
+        } Cell;
+
+        bool pop(LogEntry *entry) {
+            Cell &cell = cells[head % LOG_RING_SIZE];
+            if (cell.seq.load(std::memory_order_acquire) != head + 1)
+                return false;
+            *entry = cell.entry;
+            cell.seq.store(head + LOG_RING_SIZE, std::memory_order_release);
+            head++;
+            return true;
+        }
+
+        void drain() {
+            LogEntry entry;
+            for (;;) {
+                bool stop = stopping.load(std::memory_order_acquire);
+                bool any = false;
+                while (pop(&entry)) {
+                    reorder(entry);
+                    any = true;
+                }
+                if (stop && !any)
+                    break;
+                if (!any)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            for (auto &kv : pending)
+                write(kv.second);
+        }
+
+        void reorder(const LogEntry &entry) {
+            if (entry.frame < next) {
+                // Requested again after its turn
+                write(entry);
+                return;
+            }
+            pending[entry.frame] = entry;
+            while (!pending.empty() && (pending.begin()->first == next || pending.size() > LOG_REORDER_LIMIT)) {
+                write(pending.begin()->second);
+                next = pending.begin()->first + 1;
+                pending.erase(pending.begin());
+            }
+        }
+
+        void writeHeader() {
+            if (!csv) {
+                LogFileHeader header;
+                memcpy(header.magic, logMagic, sizeof(header.magic));
+                header.version = logVersion;
+                header.numInputs = numInputs;
+                header.numPlanes = numPlanes;
+                failed = fwrite(&header, sizeof(header), 1, f) != 1;
+                return;
+            }
+            std::string line = "frame";
+            for (int p = 0; p < numPlanes; p++)
+                line += numPlanes > 1 ? ",best" + std::to_string(p) : ",best";
+            for (int p = 0; p < numPlanes; p++) {
+                for (int i = 0; i < numInputs; i++)
+                    line += numPlanes > 1 ? ",score" + std::to_string(p) + "_" + std::to_string(i) : ",score" + std::to_string(i);
+            }
+            line += "\n";
+            failed = fputs(line.c_str(), f) < 0;
+        }
+
+        void write(const LogEntry &entry) {
+            if (!csv) {
+                bool ok = fwrite(&entry.frame, sizeof(int32_t), 1, f) == 1
+                    && fwrite(entry.best, sizeof(int32_t), numPlanes, f) == static_cast<size_t>(numPlanes);
+                for (int p = 0; p < numPlanes && ok; p++)
+                    ok = fwrite(entry.scores[p], sizeof(double), numInputs, f) == static_cast<size_t>(numInputs);
+                failed = failed || !ok;
+                return;
+            }
+            bool ok = fprintf(f, "%d", entry.frame) >= 0;
+            for (int p = 0; p < numPlanes; p++)
+                ok = fprintf(f, ",%d", entry.best[p]) >= 0 && ok;
+            for (int p = 0; p < numPlanes; p++) {
+                for (int i = 0; i < numInputs; i++)
+                    ok = fprintf(f, ",%.17g", entry.scores[p][i]) >= 0 && ok;
+            }
+            ok = fputc('\n', f) != EOF && ok;
+            failed = failed || !ok;
+        }
+
+        std::string path;
+        bool csv;
+        int numInputs;
+        int numPlanes;
+        const char *function;
+        VSCore *core;
+        const VSAPI *vsapi;
+        FILE *f;
+
+        std::unique_ptr<Cell[]> cells;
+        std::atomic<uint64_t> tail; // next cell to claim, producers
+        uint64_t head;              // next cell to read, writer only
+        std::atomic<bool> stopping;
+        std::thread writer;
+
+        // Writer thread state
+        std::map<int, LogEntry> pending;
+        int next;
+        bool failed;
+    };
+
+    // Scratch memory of an instance's frame path, so frames past the first
+    // few don't touch the heap. Blocks come in power of two size classes
+    // from 64 bytes and go on a free list after use. Every thread has its
+    // own shard of free lists (threads beyond SCRATCH_SHARDS share one), so
+    // the shard locks are practically uncontended. A block remembers the
+    // shard it was allocated for in a header in front of it and always goes
+    // back there, whichever thread gives it, so blocks don't pile up in the
+    // shards of threads that only give. Only a take() finding its shard's
+    // list empty allocates, and counts it in `allocs`. Blocks live until the
+    // pool is freed.
+    class ScratchPool {
+    public:
+        ScratchPool(std::atomic<uint64_t> *allocs) : allocs(allocs) {
+            for (Shard &shard : shards)
+                std::fill(shard.free, shard.free + SCRATCH_CLASSES, nullptr);
+        }
+
+        ~ScratchPool() {
+            for (Shard &shard : shards) {
+                for (void *block : shard.free) {
+                    while (block) {
+                        void *next = *static_cast<void **>(block);
+                        vs_aligned_free(header(block));
+                        block = next;
+                    }
+                }
+            }
+        }
+
+        void *take(size_t size) {
+            int c = sizeClass(size);
+            unsigned origin = threadShard();
+            Shard &shard = shards[origin];
+            {
+                std::lock_guard<std::mutex> lock(shard.lock);
+                void *block = shard.free[c];
+                if (block) {
+                    shard.free[c] = *static_cast<void **>(block);
+                    return block;
+                }
+            }
+            allocs->fetch_add(1, std::memory_order_relaxed);
+            Header *h = static_cast<Header *>(vs_aligned_malloc(sizeof(Header) + (static_cast<size_t>(64) << c), 64));
+            if (!h)
+                throw std::bad_alloc();
+            h->shard = origin;
+            return h + 1;
+        }
+
+        // Blocks may go back from another thread than the one that took them.
+        void give(void *block, size_t size) {
+            if (!block)
+                return;
+            int c = sizeClass(size);
+            Shard &shard = shards[header(block)->shard];
+            std::lock_guard<std::mutex> lock(shard.lock);
+            *static_cast<void **>(block) = shard.free[c];
+            shard.free[c] = block;
+        }
+
+    private:
+        struct alignas(64) Shard {
+            std::mutex lock;
+            void *free[SCRATCH_CLASSES];
+        };
+
+        // In front of every block, a whole alignment unit so blocks stay
+        // aligned to 64 bytes
+        struct alignas(64) Header {
+            unsigned shard;
+        };
+
+        static Header *header(void *block) {
+            return static_cast<Header *>(block) - 1;
+        }
+
+        static int sizeClass(size_t size) {
+            int c = 0;
+            while ((static_cast<size_t>(64) << c) < size)
+                c++;
+            return c;
+        }
+
+        // Threads are given shards in the order they first take a block
+        static unsigned threadShard() {
+            static std::atomic<unsigned> threads(0);
+            thread_local unsigned shard = threads.fetch_add(1, std::memory_order_relaxed) % SCRATCH_SHARDS;
+            return shard;
+        }
+
+        std::atomic<uint64_t> *allocs;
+        Shard shards[SCRATCH_SHARDS];
+    };
+
+    // Low resolution summary of one source frame for the temporal metric,
+    // kept in slot frame % TEMPORAL_CACHE_SIZE of its clip
+    typedef struct {
+        int frame;
+        float grid[TEMPORAL_CELLS];
+    } TemporalSummary;
+
+    // Summaries of the clips' previous frames a request found in the cache
+    // when it asked for its frames, copied so they can't leave the cache
+    // before it reads them. Bit i of `known` is set when grid[i] holds
+    // clip i's.
+    typedef struct {
+        uint64_t known;
+        float grid[MAX_VIDEO_INPUT][TEMPORAL_CELLS];
+    } TemporalPrevious;
+
+    // Decision of a Frame request, order[] ranks the clips best first.
+    // reached[i] is the last cascade stage clip i was scored in, or -1 when
+    // its frame is frozen, `stage` the one that decided (-1 when taken from
+    // the score index).
+    typedef struct {
+        int n;
+        int unique;
+        int stage;
+        int order[MAX_VIDEO_INPUT];
+        int reached[MAX_VIDEO_INPUT];
+        double scores[MAX_VIDEO_INPUT];
+    } FrameDecision;
+
+    // Timestamps of one request, held in its frameData from arInitial on.
+    typedef struct {
+        int64_t requested;
+        int64_t round; // start of the current round of requests
+        int64_t waited;
+        int64_t scored;
+    } RequestTimes;
+
+    // State of a Frame request, held in frameData. Until `decided`, clips [0, scored) have been scored group
+    // by group and kept[] holds the frames of the best of them, keptClip[k]
+    // being the clip of kept[k]. Once decided only the picked clips' frames
+    // are being fetched.
+    typedef struct {
+        FrameDecision decision;
+        bool decided;
+        int scored;
+        int numKept;
+        int keptClip[MAX_OUTPUTS];
+        const VSFrameRef *kept[MAX_OUTPUTS];
+        // The last winner the prefetch of this request went by, and whether
+        // the prefetched frames are still to be released
+        int prefetchHint;
+        bool prefetched;
+        RequestTimes times;
+        TemporalPrevious *previous; // with the temporal metric only
+    } FrameRequest;
+
+    // State of a Planes or fields request, held in frameData.
+    typedef struct {
+        RequestTimes times;
+        TemporalPrevious *previous; // with the temporal metric only
+    } PlanesRequest;
+
+    // Hot path counters of a Frame/Planes instance. Only relaxed atomic
+    // adds on the frame path, bfp.Telemetry() reads them while frames are
+    // produced. latency[k] counts frames done in under 2^k microseconds,
+    // the last bucket everything slower.
+    typedef struct {
+        const char *function;
+        int64_t id;
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> waitNs;
+        std::atomic<uint64_t> scoreNs;
+        std::atomic<uint64_t> copyNs;
+        std::atomic<uint64_t> latency[TELEMETRY_BUCKETS];
+        std::atomic<uint64_t> wins[MAX_VIDEO_INPUT];
+        std::atomic<uint64_t> hintHits; // winners the prefetch predicted
+        std::atomic<uint64_t> scratchAllocs; // heap allocations of the scratch pool
+        bool props;
+    } Telemetry;
+
     typedef struct {
         VSNodeRef *node[MAX_VIDEO_INPUT];
         VSVideoInfo vi;
         std::string property;
+        bool selectMin;
+        bool hasTarget; // scores are replaced by their distance to target
+        double target;
+        bool pixelStats;
+        bool fields; // top and bottom fields are picked separately
         int numInputs;
-        char properties[3];
+        int numPlanes;
+        ScoreProgram score[MAX_PLANES];
+        bool dedup;
+        int group; // clips requested and scored at a time
+
+        // Metric cascade. Stage 0 is score[] (or the property), stage k
+        // rescores with cascade[k - 1] the candidates within margin[k - 1]
+        // of the leader
+        int numStages;
+        ScoreProgram cascade[MAX_CASCADE - 1];
+        double margin[MAX_CASCADE - 1];
+
+        // Summaries of the last frames of every clip when a score uses the
+        // temporal metric or frozen frames are detected, TEMPORAL_CACHE_SIZE
+        // per clip. A frame within `frozen` of its previous one is frozen.
+        bool temporal;
+        bool detectFrozen;
+        double frozen;
+        std::mutex temporalLock;
+        std::vector<TemporalSummary> temporalCache;
+
+        // Outputs ahead whose likely source frames are requested early, and
+        // the last scored winner they are predicted with
+        int prefetch;
+        std::atomic<int> lastWinner;
         bool show_info;
 
-        void (VS_CC *freeNode)(VSNodeRef *);
+        // Frame n of the output uses frame n + offset[i] of clip i
+        int offset[MAX_VIDEO_INPUT];
+        int clipFrames[MAX_VIDEO_INPUT];
+
+        // Rank outputs the numRanks best clips, one per output or
+        // interleaved in a single one. When a frame feeds more than one
+        // output (Rank, diff) they read its decision from decisionNode, an
+        // internal clip that scores each frame for all of them.
+        int numOutputs;
+        int numRanks;
+        bool interleave;
+        VSNodeRef *decisionNode;
+        float diffAmp;
+
+        // Low resolution scoring of mismatched clips, outNode[i] is clip i
+        // converted to the output format or nullptr when it already matches
+        int gridWidth;
+        int gridHeight;
+        VSNodeRef *outNode[MAX_VIDEO_INPUT];
+
+        // Shard being recorded, one slot per frame of the clip
+        std::string scoresOut;
+        std::vector<uint8_t> scoreRecords;
+        std::vector<uint8_t> scoreDone;
+
+        // Merged index loaded at create time
+        std::vector<uint8_t> scoreIndex;
+
+        Telemetry telemetry;
+
+        // Decision log, nullptr when not enabled
+        std::unique_ptr<ScoreLog> log;
+
+        // Buffers of the frame path
+        std::unique_ptr<ScratchPool> scratch;
+
+#ifdef BFP_API4
+        // v4 filters have a single output, Frame and Rank create one filter
+        // per output and the last of them freed frees the instance
+        std::atomic<int> liveOutputs;
+#endif
     } bfpData;
+
+#ifdef BFP_API4
+    typedef struct {
+        bfpData *d;
+        int output;
+    } FrameOutput;
+#endif
+
+    // Live Frame/Planes instances, for bfp.Telemetry()
+    std::mutex registryLock;
+    std::vector<bfpData *> registry;
+    int64_t registryNextId = 1;
 }
 
+static size_t scoreRecordSize(int numInputs) {
+    return sizeof(ScoreRecord) + sizeof(double) * numInputs;
+};
+
+static void scoreHeaderInit(ScoreFileHeader *header, const char magic[4], const bfpData *d, int numRecords) {
+    memset(header, 0, sizeof(ScoreFileHeader));
+    memcpy(header->magic, magic, sizeof(header->magic));
+    header->version = scoreFileVersion;
+    header->numInputs = d->numInputs;
+    header->width = d->vi.width;
+    header->height = d->vi.height;
+    header->numFrames = d->vi.numFrames;
+    header->numRecords = numRecords;
+};
+
+static void scoreHeaderCheck(const ScoreFileHeader *header, const ScoreFileHeader *expected, const std::string &path) {
+    if (header->version != expected->version)
+        throw std::runtime_error(path + ": unsupported score file version.");
+    if (header->numInputs != expected->numInputs)
+        throw std::runtime_error(path + ": score file was written for a different number of clips.");
+    if (header->width != expected->width || header->height != expected->height)
+        throw std::runtime_error(path + ": score file was written for different dimensions.");
+    if (header->numFrames != expected->numFrames)
+        throw std::runtime_error(path + ": score file was written for a different number of frames.");
+};
+
+// Reads a whole score file and validates its header against `magic`.
+static std::vector<uint8_t> scoreFileRead(const std::string &path, const char magic[4]) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        throw std::runtime_error("unable to open score file " + path + ".");
+
+    std::vector<uint8_t> buf;
+    uint8_t chunk[65536];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf.insert(buf.end(), chunk, chunk + got);
+    fclose(f);
+
+    if (buf.size() < sizeof(ScoreFileHeader) || memcmp(buf.data(), magic, 4))
+        throw std::runtime_error(path + " is not a bfp score file of the expected kind.");
+
+    const ScoreFileHeader *header = reinterpret_cast<const ScoreFileHeader *>(buf.data());
+    if (header->numInputs < 1 || header->numInputs > MAX_VIDEO_INPUT || header->numRecords < 0
+        || buf.size() != sizeof(ScoreFileHeader) + scoreRecordSize(header->numInputs) * header->numRecords)
+        throw std::runtime_error(path + " is truncated or corrupt.");
+
+    // Records are trusted in getframe, so a bad winner or score is refused
+    // here. Scores may be infinite, save_scores never writes NaN. Frames an
+    // index doesn't cover are marked with -1.
+    size_t recSize = scoreRecordSize(header->numInputs);
+    for (int r = 0; r < header->numRecords; r++) {
+        const ScoreRecord *rec = reinterpret_cast<const ScoreRecord *>(buf.data() + sizeof(ScoreFileHeader) + recSize * r);
+        if (rec->frame < 0)
+            continue;
+        const double *scores = reinterpret_cast<const double *>(rec + 1);
+        bool ok = rec->frame < header->numFrames && rec->best >= 0 && rec->best < header->numInputs;
+        for (int i = 0; ok && i < header->numInputs; i++)
+            ok = !std::isnan(scores[i]);
+        if (!ok)
+            throw std::runtime_error(path + " holds an invalid record for frame " + std::to_string(rec->frame) + ".");
+    }
+    return buf;
+};
+
+static void scoreFileWrite(const std::string &path, const ScoreFileHeader *header, const uint8_t *records, size_t size) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        throw std::runtime_error("unable to create score file " + path + ".");
+    bool ok = fwrite(header, sizeof(ScoreFileHeader), 1, f) == 1
+        && (!size || fwrite(records, size, 1, f) == 1);
+    ok = !fclose(f) && ok;
+    if (!ok)
+        throw std::runtime_error("unable to write score file " + path + ".");
+};
+
+// Returns the record of frame n in the loaded index, or nullptr if the index
+// doesn't cover it.
+static const ScoreRecord *scoreIndexLookup(const bfpData *d, int n) {
+    if (d->scoreIndex.empty())
+        return nullptr;
+    const ScoreRecord *rec = reinterpret_cast<const ScoreRecord *>(
+        d->scoreIndex.data() + sizeof(ScoreFileHeader) + scoreRecordSize(d->numInputs) * n);
+    return rec->frame == n ? rec : nullptr;
+};
+
+static void scoreRecordStore(bfpData *d, int n, int best, const double scores[]) {
+    ScoreRecord *rec = reinterpret_cast<ScoreRecord *>(d->scoreRecords.data() + scoreRecordSize(d->numInputs) * n);
+    rec->frame = n;
+    rec->best = best;
+    memcpy(rec + 1, scores, sizeof(double) * d->numInputs);
+    d->scoreDone[n] = 1;
+};
+
+static void scoreShardFlush(bfpData *d, VSCore *core, const VSAPI *vsapi) {
+    size_t recSize = scoreRecordSize(d->numInputs);
+    std::vector<uint8_t> shard;
+    int numRecords = 0;
+    for (int n = 0; n < d->vi.numFrames; n++) {
+        if (!d->scoreDone[n])
+            continue;
+        const uint8_t *rec = d->scoreRecords.data() + recSize * n;
+        shard.insert(shard.end(), rec, rec + recSize);
+        numRecords++;
+    }
+
+    ScoreFileHeader header;
+    scoreHeaderInit(&header, scoreShardMagic, d, numRecords);
+    try {
+        scoreFileWrite(d->scoresOut, &header, shard.data(), shard.size());
+    } catch (const std::runtime_error &e) {
+        logWarning(std::string(d->telemetry.function) + ": " + e.what(), core, vsapi);
+    }
+};
+
+// Lists d in bfp.Telemetry() once its filter is created.
+static void bfpRegister(bfpData *d) {
+    std::lock_guard<std::mutex> lock(registryLock);
+    d->telemetry.id = registryNextId++;
+    registry.push_back(d);
+};
+
+// The video info of every output.
+static VSVideoInfo outputInfo(const bfpData *d) {
+    VSVideoInfo vi = d->vi;
+    if (d->interleave)
+        vi.numFrames *= d->numRanks;
+    return vi;
+};
+
+#ifndef BFP_API4
 static void VS_CC bfpInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     bfpData *d = reinterpret_cast<bfpData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
+    VSVideoInfo vi[MAX_OUTPUTS];
+    int numOutputs = std::max(d->numOutputs, 1);
+    for (int i = 0; i < numOutputs; i++)
+        vi[i] = outputInfo(d);
+    vsapi->setVideoInfo(vi, numOutputs, node);
+    bfpRegister(d);
+};
+
+// The getframe functions take v4's instance data, v3 passes a pointer to it.
+template <const VSFrameRef *(VS_CC *getFrame)(int, int, void *, void **, VSFrameContext *, VSCore *, const VSAPI *)>
+static const VSFrameRef *VS_CC getFrameV3(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    return getFrame(n, activationReason, *instanceData, frameData, frameCtx, core, vsapi);
 };
+#endif
 
 static void VS_CC bfpFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     bfpData *d = reinterpret_cast<bfpData *>(instanceData);
-    d->freeNode = vsapi->freeNode;
+    {
+        std::lock_guard<std::mutex> lock(registryLock);
+        registry.erase(std::remove(registry.begin(), registry.end(), d), registry.end());
+    }
+    if (!d->scoresOut.empty())
+        scoreShardFlush(d, core, vsapi);
+    vsapi->freeNode(d->decisionNode);
+    for (int i = 0; i < d->numInputs; i++) {
+        vsapi->freeNode(d->node[i]);
+        vsapi->freeNode(d->outNode[i]);
+    }
     delete d;
 }
 
-static double VS_CC getStats(const VSFrameRef *src, std::string props, int plane, VSCore *core, const VSAPI *vsapi) {
+#ifdef BFP_API4
+static void VS_CC frameOutputFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    FrameOutput *o = static_cast<FrameOutput *>(instanceData);
+    if (o->d->liveOutputs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        bfpFree(o->d, core, vsapi);
+    delete o;
+}
+#endif
+
+// The Frame or Rank instance a request is for and, unless `output` is
+// nullptr, the output it's for.
+static bfpData *frameOutput(void *instanceData, int *output, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+#ifdef BFP_API4
+    const FrameOutput *o = static_cast<const FrameOutput *>(instanceData);
+    if (output)
+        *output = o->output;
+    return o->d;
+#else
+    bfpData *d = static_cast<bfpData *>(instanceData);
+    if (output)
+        *output = d->numOutputs > 1 ? vsapi->getOutputIndex(frameCtx) : 0;
+    return d;
+#endif
+};
+
+static PlaneView planeView(const VSFrameRef *f, int plane, const VSAPI *vsapi) {
+    const VSFormat *fi = vsapi->getFrameFormat(f);
+    PlaneView p;
+    p.ptr = vsapi->getReadPtr(f, plane);
+    p.stride = vsapi->getStride(f, plane);
+    p.width = vsapi->getFrameWidth(f, plane);
+    p.height = vsapi->getFrameHeight(f, plane);
+    p.bytesPerSample = fi->bytesPerSample;
+    p.bitsPerSample = fi->bitsPerSample;
+    p.isFloat = fi->sampleType == stFloat;
+    return p;
+};
+
+// Scores every candidate with `prog`, duplicates (dup[i] != i) reuse the
+// metrics of the candidate they duplicate instead of being measured again.
+// temporal[i] is candidate i's temporal metric, which duplicates don't
+// share, and may be nullptr when `prog` doesn't use it.
+static void scoreViews(const PlaneView views[], int numInputs, const ScoreProgram *prog, const int dup[], const double temporal[], double dataset[]) {
+    PlaneView uniqueViews[MAX_VIDEO_INPUT] = {};
+    int unique[MAX_VIDEO_INPUT], weight[MAX_VIDEO_INPUT];
+    int slot[MAX_VIDEO_INPUT];
+    int numUnique = 0;
+    for (int i = 0; i < numInputs; i++) {
+        if (dup[i] == i) {
+            slot[i] = numUnique;
+            weight[numUnique] = 0;
+            unique[numUnique] = i;
+            uniqueViews[numUnique++] = views[i];
+        }
+        // Duplicates keep their share of the SSIM reference
+        weight[slot[dup[i]]]++;
+    }
+
+    double ssim[MAX_VIDEO_INPUT];
+    double metrics[MAX_VIDEO_INPUT][metricCount] = {};
+    if (prog->metrics & crossMetrics)
+        ssimConsensus(uniqueViews, numUnique, weight, ssim);
+
+    for (int u = 0; u < numUnique; u++) {
+        if (prog->metrics & ~(crossMetrics | temporalMetrics))
+            planeMetrics(uniqueViews[u], prog->metrics, metrics[unique[u]]);
+        if (prog->metrics & crossMetrics)
+            metrics[unique[u]][mSsim] = ssim[u];
+    }
+    for (int i = 0; i < numInputs; i++) {
+        if (dup[i] != i)
+            memcpy(metrics[i], metrics[dup[i]], sizeof(metrics[i]));
+        if (prog->metrics & temporalMetrics)
+            metrics[i][mTemporal] = temporal[i];
+        dataset[i] = scoreEval(prog, metrics[i]);
+    }
+};
+
+// Scores one plane of `num` frames with `prog`, reading each plane once, or
+// only the rows of field `field` when it isn't -1. Returns the number of
+// distinct inputs.
+static int scorePlane(const bfpData *d, const VSFrameRef *const src[], int num, int plane, const ScoreProgram *prog, const double temporal[], double dataset[], const VSAPI *vsapi, int field = -1) {
+    PlaneView views[MAX_VIDEO_INPUT];
+    int dup[MAX_VIDEO_INPUT];
+    for (int i = 0; i < num; i++) {
+        views[i] = planeView(src[i], plane, vsapi);
+        if (field >= 0)
+            views[i] = fieldView(views[i], field);
+    }
+    int numUnique = findDuplicates(views, num, d->dedup, dup);
+    scoreViews(views, num, prog, dup, temporal, dataset);
+    return numUnique;
+};
+
+// Scores one plane of `num` frames of any size on the common low resolution
+// grid. Returns the number of distinct inputs.
+static int scoreGrid(const bfpData *d, const VSFrameRef *const src[], int num, int plane, const ScoreProgram *prog, const double temporal[], double dataset[], const VSAPI *vsapi) {
+    size_t cells = static_cast<size_t>(d->gridWidth) * d->gridHeight;
+    size_t bytes = sizeof(float) * cells * num;
+    float *grid = static_cast<float *>(d->scratch->take(bytes));
+    PlaneView views[MAX_VIDEO_INPUT];
+    int dup[MAX_VIDEO_INPUT];
+    for (int i = 0; i < num; i++)
+        views[i] = planeView(src[i], plane, vsapi);
+    int numUnique = findDuplicates(views, num, d->dedup, dup);
+    for (int i = 0; i < num; i++) {
+        if (dup[i] == i)
+            boxDownsample(views[i], &grid[cells * i], d->gridWidth, d->gridHeight);
+        views[i] = gridView(&grid[cells * dup[i]], d->gridWidth, d->gridHeight);
+    }
+    scoreViews(views, num, prog, dup, temporal, dataset);
+    d->scratch->give(grid, bytes);
+    return numUnique;
+};
+
+// Scores whole frames with `prog`: the luma, or the mean of the channels of
+// RGB, which has no luma plane. Returns the number of distinct inputs.
+static int scoreFrames(const bfpData *d, const VSFrameRef *const src[], int num, const ScoreProgram *prog, const double temporal[], double dataset[], const VSAPI *vsapi, int field = -1) {
+    int planes = videoFormat(&d->vi)->colorFamily == cmRGB ? videoFormat(&d->vi)->numPlanes : 1;
+    double planeScores[MAX_VIDEO_INPUT];
+    int unique = 0;
+    for (int plane = 0; plane < planes; plane++) {
+        double *target = plane ? planeScores : dataset;
+        int u = d->gridWidth ? scoreGrid(d, src, num, plane, prog, temporal, target, vsapi) : scorePlane(d, src, num, plane, prog, temporal, target, vsapi, field);
+        if (plane == 0)
+            unique = u;
+        for (int k = 0; plane && k < num; k++)
+            dataset[k] += planeScores[k];
+    }
+    for (int k = 0; planes > 1 && k < num; k++)
+        dataset[k] /= planes;
+    return unique;
+};
+
+// Hashing pays off once a score needs more than the plain statistics.
+static bool dedupDefault(const ScoreProgram *prog) {
+    return (prog->metrics & ~((1u << mAvg) | (1u << mMin) | (1u << mMax))) != 0;
+};
+
+// Maps the legacy props names onto a score expression.
+static std::string propsToScore(std::string props) {
+    std::transform(props.begin(), props.end(), props.begin(), ::tolower);
+    if (props == "max"
+        || props == "maximum"
+        || props == "highest")
+    {
+        return "max";
+    } else if (props == "min"
+            || props == "minimum"
+            || props == "lowest")
+    {
+        return "min";
+    } else if (props == "avg"
+                || props == "average")
+    {
+        return "avg";
+    }
+    throw std::runtime_error("Unknown props " + props + ", must be 'max' or 'min' or 'avg'");
+};
+
+static bool parseDirection(const VSMap *in, const VSAPI *vsapi) {
+    int err;
+    const char *directionArg = vsapi->propGetData(in, "direction", 0, &err);
+    std::string direction = err ? "max" : directionArg;
+    std::transform(direction.begin(), direction.end(), direction.begin(), ::tolower);
+    if (direction == "max" || direction == "highest")
+        return false;
+    if (direction == "min" || direction == "lowest")
+        return true;
+    throw std::runtime_error("Unknown direction " + direction + ", must be 'max' or 'min'");
+};
+
+// With `target` the score closest to it wins, whatever the direction.
+static void parseTarget(bfpData *d, const VSMap *in, const VSAPI *vsapi) {
+    int err;
+    d->target = vsapi->propGetFloat(in, "target", 0, &err);
+    d->hasTarget = !err;
+    if (d->hasTarget)
+        d->selectMin = true;
+};
+
+static void applyTarget(const bfpData *d, double dataset[], int num) {
+    for (int i = 0; d->hasTarget && i < num; i++)
+        dataset[i] = std::fabs(dataset[i] - d->target);
+};
+
+// Reads the stages after the first and their margins, a missing margin
+// repeats the previous one.
+static void parseCascade(bfpData *d, const VSMap *in, const VSAPI *vsapi) {
+    int err;
+    int numCascade = std::max(0, vsapi->propNumElements(in, "cascade"));
+    int numMargins = std::max(0, vsapi->propNumElements(in, "margin"));
+    if (numCascade >= MAX_CASCADE)
+        throw std::runtime_error("cascade takes at most " + std::to_string(MAX_CASCADE - 1) + " expressions.");
+    if (numCascade && !numMargins)
+        throw std::runtime_error("cascade needs a margin.");
+    if (numCascade && d->hasTarget)
+        throw std::runtime_error("target can't be used with cascade.");
+    d->numStages = 1 + numCascade;
+    for (int k = 0; k < numCascade; k++) {
+        scoreCompile(vsapi->propGetData(in, "cascade", k, &err), &d->cascade[k]);
+        d->margin[k] = vsapi->propGetFloat(in, "margin", std::min(k, numMargins - 1), &err);
+        if (d->margin[k] < 0)
+            throw std::runtime_error("margin must not be negative.");
+    }
+};
+
+// True when clip a ranks before clip b: a later cascade stage first, then
+// the better score.
+static bool rankedBefore(const bfpData *d, const double scores[], const int reached[], int a, int b) {
+    if (reached[a] != reached[b])
+        return reached[a] > reached[b];
+    return d->selectMin ? scores[a] < scores[b] : scores[a] > scores[b];
+};
+
+// Runs the cascade on candidates scored by stage 0: while more than one is
+// within the margin of the leader, only those are scored again by the next
+// stage with rescore(clips, count, prog, scores). The others keep their
+// score. Frozen candidates (reached[i] < 0) don't take part unless all are.
+// Returns the stage that decided.
+template <typename F>
+static int cascadeRefine(const bfpData *d, double dataset[], int reached[], int num, F rescore) {
+    int alive[MAX_VIDEO_INPUT] = {};
+    int numAlive = 0;
+    for (int i = 0; i < num; i++) {
+        if (reached[i] >= 0)
+            alive[numAlive++] = i;
+    }
+    for (int i = 0; !numAlive && i < num; i++)
+        alive[numAlive++] = i;
+    for (int stage = 0;; stage++) {
+        int lead = alive[0];
+        for (int k = 1; k < numAlive; k++) {
+            if (rankedBefore(d, dataset, reached, alive[k], lead))
+                lead = alive[k];
+        }
+        if (stage + 1 == d->numStages)
+            return stage;
+        int close = 0;
+        for (int k = 0; k < numAlive; k++) {
+            if (std::fabs(dataset[alive[k]] - dataset[lead]) <= d->margin[stage])
+                alive[close++] = alive[k];
+        }
+        if (close < 2)
+            return stage;
+        numAlive = close;
+        double scores[MAX_VIDEO_INPUT];
+        rescore(alive, numAlive, &d->cascade[stage], scores);
+        for (int k = 0; k < numAlive; k++) {
+            dataset[alive[k]] = scores[k];
+            reached[alive[k]] = stage + 1;
+        }
+    }
+};
+
+// Fetches the clips and checks they can be compared plane by plane, or only
+// that they have a constant format when `mismatched` is set.
+static void loadClips(bfpData *d, const VSMap *in, bool mismatched, const VSAPI *vsapi) {
+    int err;
+    if (d->numInputs > MAX_VIDEO_INPUT) {
+        throw std::runtime_error("maximum of 32 clips are allowed.");
+    };
+    if (d->numInputs < 2) {
+        throw std::runtime_error("please provide 2 or more clips.");
+    };
+
+    for (int i = 0; i < d->numInputs; i++) {
+        d->node[i] = vsapi->propGetNode(in, "clips", i, &err);
+    };
+
+    const VSVideoInfo *vid[MAX_VIDEO_INPUT] = {};
+    for (int i = 0; i < d->numInputs; i++) {
+        vid[i] = vsapi->getVideoInfo(d->node[i]);
+        d->clipFrames[i] = vid[i]->numFrames;
+    };
+
+    for (int i = 0; i < d->numInputs; i++) {
+        if (!isConstantFormat(vid[i])) {
+            throw std::runtime_error("all inputs must have a constant format and dimensions.");
+        };
+        const VSFormat *first = videoFormat(vid[0]);
+        const VSFormat *format = videoFormat(vid[i]);
+        if (mismatched) {
+            if (first->colorFamily != format->colorFamily)
+                throw std::runtime_error("all inputs must have the same color family.");
+            continue;
+        };
+        if (first->numPlanes != format->numPlanes
+            || first->subSamplingW != format->subSamplingW
+            || first->subSamplingH != format->subSamplingH
+            || vid[0]->width != vid[i]->width
+            || vid[0]->height != vid[i]->height)
+        {
+            throw std::runtime_error("all inputs must have the same number of planes, dimensions, and also same subsampling.");
+        };
+    };
+
+    d->vi = *vid[0];
+};
+
+// Reads a numeric frame property, integer properties (like frame sizes) are
+// accepted as well. `key` is resolved once at create time.
+static double VS_CC getStats(const VSFrameRef *src, const char *key, int *err, const VSAPI *vsapi) {
     const VSMap *propsdata = vsapi->getFramePropsRO(src);
-    double res = vsapi->propGetFloat(propsdata, props.c_str(), 0, nullptr);
+    double res = vsapi->propGetFloat(propsdata, key, 0, err);
+    if (*err == peType)
+        res = static_cast<double>(vsapi->propGetInt(propsdata, key, 0, err));
     return res;
 };
 
 
+///////////////
+// Alignment //
+///////////////
+
+// Hash of every plane of the first, middle and last fingerprinted frame.
+static uint64_t fingerprintContentKey(VSNodeRef *node, int i, int numFrames, const VSAPI *vsapi) {
+    int clipFrames = vsapi->getVideoInfo(node)->numFrames;
+    uint64_t key = 0;
+    char errMsg[256];
+    for (int n : { 0, numFrames / 2, numFrames - 1 }) {
+        const VSFrameRef *f = vsapi->getFrame(std::min(n, clipFrames - 1), node, errMsg, sizeof(errMsg));
+        if (!f)
+            throw std::runtime_error("unable to fingerprint clip " + std::to_string(i) + ": " + errMsg);
+        for (int plane = 0; plane < vsapi->getFrameFormat(f)->numPlanes; plane++)
+            key = hashRound(key, planeHash(planeView(f, plane, vsapi)));
+        vsapi->freeFrame(f);
+    }
+    return key;
+};
+
+static void fingerprintHeaderInit(FingerprintHeader *header, VSNodeRef *const nodes[], int numInputs, int numFrames, const VSAPI *vsapi) {
+    memset(header, 0, sizeof(FingerprintHeader));
+    memcpy(header->magic, fingerprintMagic, sizeof(header->magic));
+    header->version = fingerprintVersion;
+    header->numInputs = numInputs;
+    header->numFrames = numFrames;
+    for (int i = 0; i < numInputs; i++) {
+        const VSVideoInfo *vi = vsapi->getVideoInfo(nodes[i]);
+        header->clipFrames[i] = vi->numFrames;
+        header->clipWidth[i] = vi->width;
+        header->clipHeight[i] = vi->height;
+        header->contentKey[i] = fingerprintContentKey(nodes[i], i, numFrames, vsapi);
+    }
+};
+
+// Writes the cache next to its final name and moves it into place, so a
+// reader never maps a half written file.
+static bool fingerprintCacheWrite(const std::string &cache, const FingerprintHeader *header, const uint8_t *prints, size_t printsSize) {
+#ifdef _WIN32
+    std::string tmp = cache + ".tmp" + std::to_string(GetCurrentProcessId());
+#else
+    std::string tmp = cache + ".tmp" + std::to_string(getpid());
+#endif
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(header, sizeof(FingerprintHeader), 1, f) == 1 && fwrite(prints, printsSize, 1, f) == 1;
+    ok = !fclose(f) && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp.c_str(), cache.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && !rename(tmp.c_str(), cache.c_str());
+#endif
+    if (!ok)
+        remove(tmp.c_str());
+    return ok;
+};
+
+// Fingerprints the first numFrames frames of every clip: the luma averaged
+// down to a small 8 bit thumbnail.
+static std::vector<uint8_t> fingerprintClips(VSNodeRef *const nodes[], int numInputs, int numFrames, const VSAPI *vsapi) {
+    std::vector<uint8_t> prints(static_cast<size_t>(fingerprintBytes) * numFrames * numInputs);
+    float thumb[fingerprintBytes];
+    char errMsg[256];
+
+    for (int i = 0; i < numInputs; i++) {
+        int clipFrames = vsapi->getVideoInfo(nodes[i])->numFrames;
+        for (int n = 0; n < numFrames; n++) {
+            uint8_t *dst = &prints[fingerprintBytes * (static_cast<size_t>(i) * numFrames + n)];
+            if (n >= clipFrames) {
+                memcpy(dst, dst - fingerprintBytes, fingerprintBytes);
+                continue;
+            }
+            const VSFrameRef *f = vsapi->getFrame(n, nodes[i], errMsg, sizeof(errMsg));
+            if (!f)
+                throw std::runtime_error("unable to fingerprint clip " + std::to_string(i) + ": " + errMsg);
+            boxDownsample(planeView(f, 0, vsapi), thumb, FINGERPRINT_SIZE, FINGERPRINT_SIZE);
+            vsapi->freeFrame(f);
+            for (int k = 0; k < fingerprintBytes; k++)
+                dst[k] = static_cast<uint8_t>(std::min(std::max(thumb[k], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+    }
+    return prints;
+};
+
+// Distance of two fingerprints with their mean brightness removed, so
+// differently graded sources still match.
+static int fingerprintDistance(const uint8_t *a, const uint8_t *b) {
+    int sumA = 0, sumB = 0;
+    for (int k = 0; k < fingerprintBytes; k++) {
+        sumA += a[k];
+        sumB += b[k];
+    }
+    int bias = (sumA - sumB) / fingerprintBytes;
+    int dist = 0;
+    for (int k = 0; k < fingerprintBytes; k++)
+        dist += std::abs(a[k] - b[k] - bias);
+    return dist;
+};
+
+// Finds, for every clip, the offset in [-radius, radius] whose fingerprints
+// correlate best with the first clip's. Fingerprints are loaded from the
+// `cache` file when it matches the clips, and written to it otherwise.
+static void alignClips(VSNodeRef *const nodes[], int numInputs, int radius, int numFrames, const std::string &cache, int offset[], VSCore *core, const VSAPI *vsapi) {
+    numFrames = std::min(numFrames, vsapi->getVideoInfo(nodes[0])->numFrames);
+    if (numFrames <= radius)
+        throw std::runtime_error("align_frames must be larger than align_radius.");
+
+    FingerprintHeader header;
+    fingerprintHeaderInit(&header, nodes, numInputs, numFrames, vsapi);
+    size_t printsSize = static_cast<size_t>(fingerprintBytes) * numFrames * numInputs;
+
+    std::unique_ptr<MappedFile> mapped;
+    std::vector<uint8_t> computed;
+    const uint8_t *prints = nullptr;
+    if (!cache.empty()) {
+        mapped.reset(new MappedFile(cache));
+        if (mapped->size == sizeof(FingerprintHeader) + printsSize && !memcmp(mapped->data, &header, sizeof(FingerprintHeader)))
+            prints = mapped->data + sizeof(FingerprintHeader);
+    }
+    if (!prints) {
+        computed = fingerprintClips(nodes, numInputs, numFrames, vsapi);
+        prints = computed.data();
+        if (!cache.empty()) {
+            mapped.reset();
+            if (!fingerprintCacheWrite(cache, &header, prints, printsSize))
+                logWarning("bfp: unable to write fingerprint cache " + cache + ".", core, vsapi);
+        }
+    }
+
+    const uint8_t *ref = prints;
+    offset[0] = 0;
+    for (int i = 1; i < numInputs; i++) {
+        const uint8_t *clip = prints + static_cast<size_t>(fingerprintBytes) * numFrames * i;
+        int clipFrames = std::min(numFrames, vsapi->getVideoInfo(nodes[i])->numFrames);
+        double bestCost = -1;
+        for (int o = -radius; o <= radius; o++) {
+            int64_t cost = 0;
+            int pairs = 0;
+            for (int n = std::max(0, -o); n < numFrames && n + o < clipFrames; n++, pairs++)
+                cost += fingerprintDistance(ref + fingerprintBytes * n, clip + fingerprintBytes * (n + o));
+            if (!pairs)
+                continue;
+            double mean = static_cast<double>(cost) / pairs;
+            if (bestCost < 0 || mean < bestCost) {
+                bestCost = mean;
+                offset[i] = o;
+            }
+        }
+    }
+};
+
+// Frame of clip i that lines up with output frame n.
+static int sourceFrame(const bfpData *d, int i, int n) {
+    return std::min(std::max(n + d->offset[i], 0), d->clipFrames[i] - 1);
+};
+
+// Drops our and the frame context's reference to a source frame, so the
+// core can recycle it before this request completes. The v3 API has no
+// request patterns to declare this up front, this is its closest equivalent.
+static void releaseSource(const bfpData *d, int i, int n, const VSFrameRef *f, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    vsapi->freeFrame(f);
+    vsapi->releaseFrameEarly(d->node[i], sourceFrame(d, i, n), frameCtx);
+};
+
+static void loadAlignment(bfpData *d, const VSMap *in, VSCore *core, const VSAPI *vsapi) {
+    int err;
+    int radius = int64ToIntS(vsapi->propGetInt(in, "align_radius", 0, &err));
+    if (err || radius <= 0)
+        return;
+    int numFrames = int64ToIntS(vsapi->propGetInt(in, "align_frames", 0, &err));
+    if (err)
+        numFrames = 240;
+    const char *cache = vsapi->propGetData(in, "align_cache", 0, &err);
+    alignClips(d->node, d->numInputs, radius, numFrames, err ? "" : cache, d->offset, core, vsapi);
+};
+
+
+//////////////
+// Temporal //
+//////////////
+
+// Summaries are kept when any stage of the score uses the temporal metric
+// or frozen frames are detected.
+static void temporalInit(bfpData *d, int numPrograms, const VSMap *in, const VSAPI *vsapi) {
+    int err;
+    d->frozen = vsapi->propGetFloat(in, "frozen", 0, &err);
+    d->detectFrozen = !err;
+    if (d->detectFrozen && d->frozen < 0)
+        throw std::runtime_error("frozen must not be negative.");
+
+    unsigned metrics = 0;
+    for (int k = 0; k < numPrograms; k++)
+        metrics |= d->score[k].metrics;
+    for (int k = 0; k < d->numStages - 1; k++)
+        metrics |= d->cascade[k].metrics;
+    d->temporal = d->detectFrozen || (metrics & temporalMetrics) != 0;
+    if (!d->temporal)
+        return;
+    TemporalSummary empty;
+    empty.frame = -1;
+    d->temporalCache.assign(static_cast<size_t>(d->numInputs) * TEMPORAL_CACHE_SIZE, empty);
+};
+
+// Luma of a frame box-averaged onto the summary grid, or the mean of R, G
+// and B.
+static void temporalSummary(const VSFrameRef *f, float grid[], const VSAPI *vsapi) {
+    int planes = vsapi->getFrameFormat(f)->colorFamily == cmRGB ? 3 : 1;
+    boxDownsample(planeView(f, 0, vsapi), grid, TEMPORAL_WIDTH, TEMPORAL_HEIGHT);
+    for (int plane = 1; plane < planes; plane++) {
+        float channel[TEMPORAL_CELLS];
+        boxDownsample(planeView(f, plane, vsapi), channel, TEMPORAL_WIDTH, TEMPORAL_HEIGHT);
+        for (int c = 0; c < TEMPORAL_CELLS; c++)
+            grid[c] += channel[c];
+    }
+    for (int c = 0; planes > 1 && c < TEMPORAL_CELLS; c++)
+        grid[c] /= planes;
+};
+
+static TemporalSummary *temporalSlot(bfpData *d, int i, int frame) {
+    return &d->temporalCache[static_cast<size_t>(i) * TEMPORAL_CACHE_SIZE + frame % TEMPORAL_CACHE_SIZE];
+};
+
+// Copies the summary of frame `frame` of clip i to `grid` when it is cached.
+static bool temporalLookup(bfpData *d, int i, int frame, float grid[]) {
+    std::lock_guard<std::mutex> lock(d->temporalLock);
+    const TemporalSummary *slot = temporalSlot(d, i, frame);
+    if (slot->frame != frame)
+        return false;
+    if (grid)
+        memcpy(grid, slot->grid, sizeof(slot->grid));
+    return true;
+};
+
+static void temporalStore(bfpData *d, int i, int frame, const float grid[]) {
+    std::lock_guard<std::mutex> lock(d->temporalLock);
+    TemporalSummary *slot = temporalSlot(d, i, frame);
+    slot->frame = frame;
+    memcpy(slot->grid, grid, sizeof(slot->grid));
+};
+
+static TemporalPrevious *temporalPreviousCreate(bfpData *d) {
+    if (!d->temporal)
+        return nullptr;
+    TemporalPrevious *previous = static_cast<TemporalPrevious *>(d->scratch->take(sizeof(TemporalPrevious)));
+    previous->known = 0;
+    return previous;
+};
+
+static void temporalPreviousFree(bfpData *d, TemporalPrevious *previous) {
+    d->scratch->give(previous, sizeof(TemporalPrevious));
+};
+
+// Takes clip i's previous summary into `previous` when it is cached, and
+// requests the previous frame when it isn't.
+static void temporalRequest(bfpData *d, int i, int n, TemporalPrevious *previous, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int frame = sourceFrame(d, i, n);
+    if (frame == 0)
+        return;
+    if (temporalLookup(d, i, frame - 1, previous->grid[i]))
+        previous->known |= 1ull << i;
+    else
+        vsapi->requestFrameFilter(frame - 1, d->node[i], frameCtx);
+};
+
+// Difference of clips [first, first + num) against their own previous
+// frame, src[k] being the frame of clip first + k, with the summaries
+// temporalRequest took or the previous frames it requested. The first frame
+// has nothing to differ from and scores 0. Returns the frozen clips as a
+// mask by clip index, frames without a previous one are never frozen.
+static uint64_t temporalScores(bfpData *d, int n, int first, int num, const VSFrameRef *const src[], const TemporalPrevious *previous, double out[], VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    uint64_t frozen = 0;
+    float current[TEMPORAL_CELLS], read[TEMPORAL_CELLS];
+    for (int k = 0; k < num; k++) {
+        int i = first + k;
+        int frame = sourceFrame(d, i, n);
+        temporalSummary(src[k], current, vsapi);
+        temporalStore(d, i, frame, current);
+        out[k] = 0;
+        if (frame == 0)
+            continue;
+        const float *grid = previous->grid[i];
+        if (!(previous->known >> i & 1)) {
+            const VSFrameRef *prev = vsapi->getFrameFilter(frame - 1, d->node[i], frameCtx);
+            temporalSummary(prev, read, vsapi);
+            temporalStore(d, i, frame - 1, read);
+            vsapi->freeFrame(prev);
+            grid = read;
+        }
+        out[k] = temporalDistance(current, grid);
+        if (d->detectFrozen && out[k] <= d->frozen)
+            frozen |= 1ull << i;
+    }
+    return frozen;
+};
+
+// Frozen clips rank behind all others, unless every clip is frozen.
+static void excludeFrozen(uint64_t frozen, int first, int num, int reached[]) {
+    for (int k = 0; k < num; k++) {
+        if (frozen >> (first + k) & 1)
+            reached[k] = -1;
+    }
+};
+
+static int64_t frozenMask(const int reached[], int num) {
+    int64_t mask = 0;
+    for (int i = 0; i < num; i++) {
+        if (reached[i] < 0)
+            mask |= 1ll << i;
+    }
+    return mask;
+};
+
+// Picks the winner of one selection from its stage 0 scores, running the
+// cascade with rescore() and passing over frozen clips.
+template <typename F>
+static int pickWinner(const bfpData *d, double dataset[], uint64_t frozen, int num, int64_t *stage, F rescore) {
+    *stage = 0;
+    if (d->numStages < 2 && !frozen)
+        return d->selectMin ? findMinIndex(dataset, num) : findMaxIndex(dataset, num);
+    int reached[MAX_VIDEO_INPUT] = {};
+    excludeFrozen(frozen, 0, num, reached);
+    if (d->numStages > 1)
+        *stage = cascadeRefine(d, dataset, reached, num, rescore);
+    int best = 0;
+    for (int i = 1; i < num; i++) {
+        if (rankedBefore(d, dataset, reached, i, best))
+            best = i;
+    }
+    return best;
+};
+
+
+////////////
+// Fields //
+////////////
+
+// Writes the rows of the top field of plane `plane` from `top` and those of
+// the bottom field from `bottom`, a single copy of the plane.
+static void weavePlane(VSFrameRef *dst, const VSFrameRef *top, const VSFrameRef *bottom, int plane, const VSAPI *vsapi) {
+    int height = vsapi->getFrameHeight(dst, plane);
+    int rowSize = vsapi->getFrameWidth(dst, plane) * vsapi->getFrameFormat(dst)->bytesPerSample;
+    int stride = vsapi->getStride(dst, plane);
+    uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+    const VSFrameRef *fields[2] = { top, bottom };
+    for (int field = 0; field < 2; field++) {
+        int srcStride = vsapi->getStride(fields[field], plane);
+        vs_bitblt(dstp + stride * field, stride * 2, vsapi->getReadPtr(fields[field], plane) + srcStride * field, srcStride * 2, rowSize, (height - field + 1) / 2);
+    }
+};
+
+// Interlaced content needs an even number of rows in every plane.
+static void checkFields(const VSVideoInfo *vi) {
+    if (!vi->height || vi->height % (2 << videoFormat(vi)->subSamplingH))
+        throw std::runtime_error("fields needs a height divisible by " + std::to_string(2 << videoFormat(vi)->subSamplingH) + ".");
+};
+
+
+///////////////
+// Telemetry //
+///////////////
+
+static int64_t telemetryNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+};
+
+// Marks a round of source requests, the first one starts the request.
+static void telemetryRequest(RequestTimes *times, bool first) {
+    int64_t now = telemetryNow();
+    if (first) {
+        times->requested = now;
+        times->waited = 0;
+        times->scored = 0;
+    }
+    times->round = now;
+};
+
+// Marks the requested frames as ready, returns the current time.
+static int64_t telemetryReady(bfpData *d, RequestTimes *times) {
+    int64_t now = telemetryNow();
+    int64_t waited = now - times->round;
+    times->waited += waited;
+    d->telemetry.waitNs.fetch_add(waited, std::memory_order_relaxed);
+    return now;
+};
+
+static int64_t telemetryScored(bfpData *d, RequestTimes *times, int64_t start) {
+    int64_t now = telemetryNow();
+    times->scored += now - start;
+    d->telemetry.scoreNs.fetch_add(now - start, std::memory_order_relaxed);
+    return now;
+};
+
+// Accounts a finished output frame built since `start`. Picks of clips are
+// counted only when `winners` is given.
+static void telemetryFrame(bfpData *d, const RequestTimes *times, int64_t start, const int64_t winners[], int numWinners, VSFrameRef *dst, const VSAPI *vsapi) {
+    Telemetry &t = d->telemetry;
+    int64_t now = telemetryNow();
+    t.copyNs.fetch_add(now - start, std::memory_order_relaxed);
+    t.frames.fetch_add(1, std::memory_order_relaxed);
+    for (int k = 0; winners && k < numWinners; k++)
+        t.wins[winners[k]].fetch_add(1, std::memory_order_relaxed);
+
+    int64_t latency = now - times->requested;
+    uint64_t us = static_cast<uint64_t>(std::max<int64_t>(latency, 0)) / 1000;
+    int bucket = 0;
+    while (bucket < TELEMETRY_BUCKETS - 1 && us >= (1ull << bucket))
+        bucket++;
+    t.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (t.props) {
+        VSMap *rwprops = vsapi->getFramePropsRW(dst);
+        vsapi->propSetInt(rwprops, "bfpInstance", t.id, paReplace);
+        vsapi->propSetFloat(rwprops, "bfpWaitUs", times->waited / 1000.0, paReplace);
+        vsapi->propSetFloat(rwprops, "bfpScoreUs", times->scored / 1000.0, paReplace);
+        vsapi->propSetFloat(rwprops, "bfpLatencyUs", latency / 1000.0, paReplace);
+    }
+};
+
+static void telemetryInit(bfpData *d, const char *function, const VSMap *in, const VSAPI *vsapi) {
+    int err;
+    d->telemetry.function = function;
+    d->telemetry.props = !!vsapi->propGetInt(in, "telemetry_props", 0, &err);
+};
+
+// Starts the decision log when `log` is given.
+static void logInit(bfpData *d, const char *function, int numPlanes, const VSMap *in, VSCore *core, const VSAPI *vsapi) {
+    int err;
+    const char *path = vsapi->propGetData(in, "log", 0, &err);
+    if (err)
+        return;
+    const char *format = vsapi->propGetData(in, "log_format", 0, &err);
+    if (err)
+        format = "csv";
+    if (strcmp(format, "csv") && strcmp(format, "binary"))
+        throw std::runtime_error("log_format must be csv or binary.");
+    d->log.reset(new ScoreLog(path, !strcmp(format, "csv"), d->numInputs, numPlanes, function, core, vsapi));
+};
+
+
+// Counters of every live Frame/Planes instance, one array element per
+// instance. latency and wins are concatenated, TELEMETRY_BUCKETS and
+// `inputs` entries per instance.
+static void VS_CC telemetryCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::lock_guard<std::mutex> lock(registryLock);
+    vsapi->propSetInt(out, "instances", registry.size(), paReplace);
+    for (int k = 0; k < TELEMETRY_BUCKETS; k++)
+        vsapi->propSetInt(out, "latency_us", k < TELEMETRY_BUCKETS - 1 ? 1ll << k : -1, paAppend);
+    for (const bfpData *d : registry) {
+        const Telemetry &t = d->telemetry;
+        vsapi->propSetInt(out, "id", t.id, paAppend);
+#ifdef BFP_API4
+        vsapi->mapSetData(out, "function", t.function, -1, dtUtf8, maAppend);
+#else
+        vsapi->propSetData(out, "function", t.function, -1, paAppend);
+#endif
+        vsapi->propSetInt(out, "inputs", d->numInputs, paAppend);
+        vsapi->propSetInt(out, "frames", t.frames.load(std::memory_order_relaxed), paAppend);
+        vsapi->propSetInt(out, "wait_ns", t.waitNs.load(std::memory_order_relaxed), paAppend);
+        vsapi->propSetInt(out, "score_ns", t.scoreNs.load(std::memory_order_relaxed), paAppend);
+        vsapi->propSetInt(out, "copy_ns", t.copyNs.load(std::memory_order_relaxed), paAppend);
+        for (int k = 0; k < TELEMETRY_BUCKETS; k++)
+            vsapi->propSetInt(out, "latency", t.latency[k].load(std::memory_order_relaxed), paAppend);
+        for (int i = 0; i < d->numInputs; i++)
+            vsapi->propSetInt(out, "wins", t.wins[i].load(std::memory_order_relaxed), paAppend);
+        vsapi->propSetInt(out, "hint_hits", t.hintHits.load(std::memory_order_relaxed), paAppend);
+        vsapi->propSetInt(out, "scratch_allocs", t.scratchAllocs.load(std::memory_order_relaxed), paAppend);
+    }
+};
+
+
 ///////////////////
 // Better Frames //
 ///////////////////
 
-static const VSFrameRef *VS_CC betterFrameGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    bfpData *d = reinterpret_cast<bfpData *>(*instanceData);
+static VSNodeRef *outputNode(const bfpData *d, int i) {
+    return d->outNode[i] ? d->outNode[i] : d->node[i];
+};
+
+// Orders the clips best first, ties keep the lower index first.
+static void rankCandidates(const bfpData *d, FrameDecision *decision) {
+    for (int i = 0; i < d->numInputs; i++)
+        decision->order[i] = i;
+    std::stable_sort(decision->order, decision->order + d->numInputs, [d, decision](int a, int b) {
+        return rankedBefore(d, decision->scores, decision->reached, a, b);
+    });
+};
+
+// Fills `decision` from the loaded score index.
+static bool decisionLookup(bfpData *d, int n, FrameDecision *decision) {
+    const ScoreRecord *known = scoreIndexLookup(d, n);
+    if (!known)
+        return false;
+    decision->n = n;
+    decision->unique = 0;
+    decision->stage = -1;
+    std::fill(decision->reached, decision->reached + d->numInputs, 0);
+    memcpy(decision->scores, known + 1, sizeof(double) * d->numInputs);
+    rankCandidates(d, decision);
+    // The recorded winner stands even if the scores tie differently
+    int *best = std::find(decision->order, decision->order + d->numInputs, known->best);
+    std::rotate(decision->order, best, best + 1);
+    return true;
+};
+
+// Output `output` is built from the clips ranked [outputFirst, outputNeeds).
+static int outputFirst(const bfpData *d, int output) {
+    return d->numRanks ? output : 0;
+};
+
+static int outputNeeds(const bfpData *d, int output) {
+    if (d->numRanks)
+        return output + 1;
+    return output == 0 ? 1 : 2;
+};
+
+static VSFrameRef *betterFrameFinish(bfpData *d, int n, const FrameDecision *decision, const VSFrameRef *src, VSCore *core, const VSAPI *vsapi) {
+    int best = decision->order[0];
+    VSFrameRef *best_frame = vsapi->copyFrame(src, core);
+    VSMap *rwprops = vsapi->getFramePropsRW(best_frame);
+    vsapi->propSetFloat(rwprops, "bfpBestNum", decision->scores[best], paReplace);
+    vsapi->propSetInt(rwprops, "bfpBestIndex", best, paReplace);
+    if (decision->unique)
+        vsapi->propSetInt(rwprops, "bfpUniqueInputs", decision->unique, paReplace);
+    if (d->numStages > 1 && decision->stage >= 0)
+        vsapi->propSetInt(rwprops, "bfpCascadeStage", decision->stage, paReplace);
+    if (d->detectFrozen && decision->stage >= 0)
+        vsapi->propSetInt(rwprops, "bfpFrozenMask", frozenMask(decision->reached, d->numInputs), paReplace);
+    if (!d->scoresOut.empty())
+        scoreRecordStore(d, n, best, decision->scores);
+    if (d->log) {
+        LogEntry entry;
+        entry.frame = n;
+        entry.best[0] = best;
+        memcpy(entry.scores[0], decision->scores, sizeof(double) * d->numInputs);
+        d->log->push(entry);
+    }
+    return best_frame;
+};
+
+// Amplified difference between the winner and the runner-up.
+static VSFrameRef *betterFrameDiff(bfpData *d, const FrameDecision *decision, const VSFrameRef *best, const VSFrameRef *runnerUp, VSCore *core, const VSAPI *vsapi) {
+    VSFrameRef *dst = vsapi->newVideoFrame(videoFormat(&d->vi), d->vi.width, d->vi.height, best, core);
+    for (int plane = 0; plane < videoFormat(&d->vi)->numPlanes; plane++)
+        diffPlane(planeView(best, plane, vsapi), planeView(runnerUp, plane, vsapi), vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), d->diffAmp);
+    VSMap *rwprops = vsapi->getFramePropsRW(dst);
+    vsapi->propSetInt(rwprops, "bfpBestIndex", decision->order[0], paReplace);
+    vsapi->propSetInt(rwprops, "bfpRunnerUpIndex", decision->order[1], paReplace);
+    return dst;
+};
+
+// Frame of the clip ranked `rank`, the best one is also recorded like
+// Frame's.
+static VSFrameRef *betterFrameRanked(bfpData *d, int n, int rank, const FrameDecision *decision, const VSFrameRef *src, VSCore *core, const VSAPI *vsapi) {
+    int clip = decision->order[rank];
+    VSFrameRef *dst = rank == 0 ? betterFrameFinish(d, n, decision, src, core, vsapi) : vsapi->copyFrame(src, core);
+    VSMap *rwprops = vsapi->getFramePropsRW(dst);
+    vsapi->propSetInt(rwprops, "bfpRank", rank, paReplace);
+    vsapi->propSetInt(rwprops, "bfpRankIndex", clip, paReplace);
+    vsapi->propSetFloat(rwprops, "bfpRankNum", decision->scores[clip], paReplace);
+    return dst;
+};
+
+// Builds output `output` from frames of its ranked clips, src[k] being the
+// frame of decision->order[k].
+static VSFrameRef *betterFrameOutput(bfpData *d, int n, int output, const FrameDecision *decision, const VSFrameRef *const src[], VSCore *core, const VSAPI *vsapi) {
+    if (d->numRanks)
+        return betterFrameRanked(d, n, output, decision, src[output], core, vsapi);
+    if (output == 0)
+        return betterFrameFinish(d, n, decision, src[0], core, vsapi);
+    return betterFrameDiff(d, decision, src[0], src[1], core, vsapi);
+};
+
+// A saved shard must load again, so NaN scores fail the frame instead of
+// being written.
+static bool scoresRecordable(const bfpData *d, int first, int num, const double dataset[], VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    if (d->scoresOut.empty())
+        return true;
+    for (int k = 0; k < num; k++) {
+        if (std::isnan(dataset[k])) {
+            vsapi->setFilterError((std::string(d->telemetry.function) + ": clip " + std::to_string(first + k) + " scored NaN, which save_scores can't record.").c_str(), frameCtx);
+            return false;
+        }
+    }
+    return true;
+};
+
+// Scores clips [first, first + num) into `decision`, src[k] being the frame
+// of clip first + k. False when a clip lacks the scored frame property.
+static bool betterFrameScore(bfpData *d, int first, int num, const VSFrameRef *const src[], const TemporalPrevious *previous, FrameDecision *decision, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    double *dataset = decision->scores + first;
+    std::fill(decision->reached + first, decision->reached + first + num, 0);
+    double temporal[MAX_VIDEO_INPUT];
+    if (d->temporal)
+        excludeFrozen(temporalScores(d, decision->n, first, num, src, previous, temporal, frameCtx, vsapi), first, num, decision->reached + first);
+    if (d->pixelStats) {
+        decision->unique += scoreFrames(d, src, num, &d->score[0], temporal, dataset, vsapi);
+    } else {
+        for (int k = 0; k < num; k++) {
+            int err = 0;
+            dataset[k] = getStats(src[k], d->property.c_str(), &err, vsapi);
+            if (err) {
+                vsapi->setFilterError((std::string(d->telemetry.function) + ": clip " + std::to_string(first + k) + " has no numeric frame property " + d->property + ".").c_str(), frameCtx);
+                return false;
+            }
+        }
+    }
+    applyTarget(d, dataset, num);
+    if (!scoresRecordable(d, first, num, dataset, frameCtx, vsapi))
+        return false;
+
+    // The cascade only runs without groups, all clips are here
+    decision->stage = 0;
+    if (d->numStages > 1) {
+        decision->stage = cascadeRefine(d, dataset, decision->reached, num, [d, src, &temporal, vsapi](const int clips[], int count, const ScoreProgram *prog, double scores[]) {
+            const VSFrameRef *close[MAX_VIDEO_INPUT];
+            double closeTemporal[MAX_VIDEO_INPUT];
+            for (int k = 0; k < count; k++) {
+                close[k] = src[clips[k]];
+                closeTemporal[k] = temporal[clips[k]];
+            }
+            scoreFrames(d, close, count, prog, closeTemporal, scores, vsapi);
+        });
+        if (!scoresRecordable(d, first, num, dataset, frameCtx, vsapi))
+            return false;
+    }
+    return true;
+};
+
+// Keeps the frames of the best `needs` clips among the kept ones and the
+// group just scored, src[k] being the frame of clip first + k. Everything
+// else goes right away.
+static void betterFrameKeep(bfpData *d, int n, int needs, FrameRequest *request, int first, int num, const VSFrameRef *const src[], VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int clip[MAX_OUTPUTS + MAX_VIDEO_INPUT];
+    const VSFrameRef *frame[MAX_OUTPUTS + MAX_VIDEO_INPUT];
+    int numCandidates = 0;
+    for (int k = 0; k < request->numKept; k++, numCandidates++) {
+        clip[numCandidates] = request->keptClip[k];
+        frame[numCandidates] = request->kept[k];
+    }
+    for (int k = 0; k < num; k++, numCandidates++) {
+        clip[numCandidates] = first + k;
+        frame[numCandidates] = src[k];
+    }
+
+    // Same order as rankCandidates: best first, ties keep the lower index first
+    const FrameDecision *decision = &request->decision;
+    int rank[MAX_OUTPUTS + MAX_VIDEO_INPUT];
+    for (int k = 0; k < numCandidates; k++)
+        rank[k] = k;
+    std::sort(rank, rank + numCandidates, [d, decision, clip](int a, int b) {
+        if (rankedBefore(d, decision->scores, decision->reached, clip[a], clip[b]))
+            return true;
+        if (rankedBefore(d, decision->scores, decision->reached, clip[b], clip[a]))
+            return false;
+        return clip[a] < clip[b];
+    });
+
+    request->numKept = std::min(needs, numCandidates);
+    for (int k = 0; k < numCandidates; k++) {
+        int c = rank[k];
+        if (k < request->numKept) {
+            request->keptClip[k] = clip[c];
+            request->kept[k] = frame[c];
+        } else {
+            releaseSource(d, clip[c], n, frame[c], frameCtx, vsapi);
+        }
+    }
+};
+
+static void betterFrameRelease(bfpData *d, int n, FrameRequest *request, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    for (int k = 0; k < request->numKept; k++)
+        releaseSource(d, request->keptClip[k], n, request->kept[k], frameCtx, vsapi);
+    request->numKept = 0;
+};
+
+// Requests the frames the picked clips' output is built from.
+static void betterFrameFetch(bfpData *d, int n, int first, int needs, FrameRequest *request, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    request->decided = true;
+    for (int k = first; k < needs; k++)
+        vsapi->requestFrameFilter(sourceFrame(d, request->decision.order[k], n), outputNode(d, request->decision.order[k]), frameCtx);
+};
+
+// The clip whose frame for output n + j is prefetched, and its node, or -1.
+// The loaded score index knows the winners, otherwise the last winner is
+// assumed to keep winning. A clip that is shorter or aligned past its end
+// repeats the frame this request reads itself, which is never prefetched.
+static int prefetchClip(const bfpData *d, int n, int j, int hint, VSNodeRef **node) {
+    const ScoreRecord *known = scoreIndexLookup(d, n + j);
+    int clip = known ? known->best : hint;
+    if (clip < 0 || sourceFrame(d, clip, n + j) == sourceFrame(d, clip, n))
+        return -1;
+    *node = known ? outputNode(d, clip) : d->node[clip];
+    return clip;
+};
+
+// Requests the frames the next `prefetch` outputs will most likely read, so
+// the decoder of the likely source runs ahead and the frames are cached
+// when those outputs ask for them. Returns the hint it went by.
+static int betterFramePrefetch(bfpData *d, int n, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int hint = d->lastWinner.load(std::memory_order_relaxed);
+    for (int j = 1; j <= d->prefetch && n + j < d->vi.numFrames; j++) {
+        VSNodeRef *node;
+        int clip = prefetchClip(d, n, j, hint, &node);
+        if (clip >= 0)
+            vsapi->requestFrameFilter(sourceFrame(d, clip, n + j), node, frameCtx);
+    }
+    return hint;
+};
+
+// This request doesn't read the prefetched frames, the cache holds them.
+// Only what betterFramePrefetch requested with the same hint is released.
+static void betterFramePrefetchRelease(bfpData *d, int n, int hint, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    for (int j = 1; j <= d->prefetch && n + j < d->vi.numFrames; j++) {
+        VSNodeRef *node;
+        int clip = prefetchClip(d, n, j, hint, &node);
+        if (clip >= 0)
+            vsapi->releaseFrameEarly(node, sourceFrame(d, clip, n + j), frameCtx);
+    }
+};
+
+// Remembers the winner for the prefetch of the following requests.
+static void betterFrameHint(bfpData *d, int winner) {
+    if (d->lastWinner.exchange(winner, std::memory_order_relaxed) == winner)
+        d->telemetry.hintHits.fetch_add(1, std::memory_order_relaxed);
+};
+
+// State of a request that takes more rounds, from the scratch pool.
+static FrameRequest *requestCreate(bfpData *d, const FrameRequest &init) {
+    return new (d->scratch->take(sizeof(FrameRequest))) FrameRequest(init);
+};
+
+static void requestFree(bfpData *d, FrameRequest *request) {
+    temporalPreviousFree(d, request->previous);
+    d->scratch->give(request, sizeof(FrameRequest));
+};
+
+static void betterFrameRequestGroup(bfpData *d, int n, int first, FrameRequest *request, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int last = std::min(first + d->group, d->numInputs);
+    for (int i = first; i < last; i++) {
+        vsapi->requestFrameFilter(sourceFrame(d, i, n), d->node[i], frameCtx);
+        if (d->temporal)
+            temporalRequest(d, i, n, request->previous, frameCtx, vsapi);
+    }
+};
+
+// Scores the group of clips whose frames just arrived and keeps the frames
+// of the best `needs` clips so far. Requests the next group when one is
+// left, otherwise ranks the clips. Returns -1 when scoring failed, 0 while
+// groups are left and 1 once the decision is complete.
+static int betterFrameScoreGroup(bfpData *d, int n, int needs, FrameRequest *request, int64_t *start, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int base = request->scored;
+    int num = std::min(d->group, d->numInputs - base);
+    const VSFrameRef *src[MAX_VIDEO_INPUT];
+    for (int k = 0; k < num; k++)
+        src[k] = vsapi->getFrameFilter(sourceFrame(d, base + k, n), d->node[base + k], frameCtx);
+
+    if (!betterFrameScore(d, base, num, src, request->previous, &request->decision, frameCtx, vsapi)) {
+        for (int k = 0; k < num; k++)
+            vsapi->freeFrame(src[k]);
+        return -1;
+    }
+    *start = telemetryScored(d, &request->times, *start);
+    betterFrameKeep(d, n, needs, request, base, num, src, frameCtx, vsapi);
+    request->scored += num;
+
+    if (request->scored < d->numInputs) {
+        telemetryRequest(&request->times, false);
+        betterFrameRequestGroup(d, n, request->scored, request, frameCtx, vsapi);
+        return 0;
+    }
+    rankCandidates(d, &request->decision);
+    if (d->prefetch)
+        betterFrameHint(d, request->decision.order[0]);
+    return 1;
+};
+
+// Frame n of the decision node is a 1x1 frame carrying frame n's decision
+// in its props.
+static VSFrameRef *decisionFrame(const bfpData *d, const FrameDecision *decision, VSCore *core, const VSAPI *vsapi) {
+    VSFrameRef *dst = vsapi->newVideoFrame(videoFormat(vsapi->getVideoInfo(d->decisionNode)), 1, 1, nullptr, core);
+    int64_t order[MAX_VIDEO_INPUT], reached[MAX_VIDEO_INPUT];
+    for (int i = 0; i < d->numInputs; i++) {
+        order[i] = decision->order[i];
+        reached[i] = decision->reached[i];
+    }
+    VSMap *rwprops = vsapi->getFramePropsRW(dst);
+    vsapi->propSetIntArray(rwprops, "bfpOrder", order, d->numInputs);
+    vsapi->propSetIntArray(rwprops, "bfpReached", reached, d->numInputs);
+    vsapi->propSetFloatArray(rwprops, "bfpScores", decision->scores, d->numInputs);
+    vsapi->propSetInt(rwprops, "bfpUnique", decision->unique, paReplace);
+    vsapi->propSetInt(rwprops, "bfpStage", decision->stage, paReplace);
+    return dst;
+};
+
+static void decisionRead(const bfpData *d, const VSFrameRef *f, FrameDecision *decision, const VSAPI *vsapi) {
+    const VSMap *props = vsapi->getFramePropsRO(f);
+    for (int i = 0; i < d->numInputs; i++) {
+        decision->order[i] = int64ToIntS(vsapi->propGetInt(props, "bfpOrder", i, nullptr));
+        decision->reached[i] = int64ToIntS(vsapi->propGetInt(props, "bfpReached", i, nullptr));
+        decision->scores[i] = vsapi->propGetFloat(props, "bfpScores", i, nullptr);
+    }
+    decision->unique = int64ToIntS(vsapi->propGetInt(props, "bfpUnique", 0, nullptr));
+    decision->stage = int64ToIntS(vsapi->propGetInt(props, "bfpStage", 0, nullptr));
+};
+
+#ifndef BFP_API4
+static void VS_CC decisionInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    const bfpData *d = reinterpret_cast<const bfpData *>(*instanceData);
+    VSVideoInfo vi = d->vi;
+    vi.format = vsapi->getFormatPreset(pfGray8, core);
+    vi.width = 1;
+    vi.height = 1;
+    vsapi->setVideoInfo(&vi, 1, node);
+};
+#else
+// Request patterns of a filter's frame n, frame n of every clip unless an
+// alignment offset, a different length or the temporal metric (or for the
+// outputs, prefetch or interleave) make it read others too. The outputs
+// also read the converted clips and the decision node.
+static int filterDependencies(const bfpData *d, bool outputs, VSFilterDependency deps[]) {
+    bool general = d->temporal || (outputs && (d->prefetch || d->interleave));
+    int numDeps = 0;
+    for (int i = 0; i < d->numInputs; i++) {
+        int pattern = general || d->offset[i] || d->clipFrames[i] != d->vi.numFrames ? rpGeneral : rpStrictSpatial;
+        deps[numDeps++] = {d->node[i], pattern};
+        if (outputs && d->outNode[i])
+            deps[numDeps++] = {d->outNode[i], pattern};
+    }
+    if (outputs && d->decisionNode)
+        deps[numDeps++] = {d->decisionNode, d->interleave ? rpGeneral : rpStrictSpatial};
+    return numDeps;
+};
+#endif
+
+// The decision node scores every clip of frame n and keeps none of their
+// frames. The outputs request its frame n instead of scoring themselves,
+// and the core produces a frame once for all requests of it that overlap,
+// then keeps it in its cache.
+static const VSFrameRef *VS_CC decisionGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    bfpData *d = static_cast<bfpData *>(instanceData);
+    FrameRequest *request = reinterpret_cast<FrameRequest *>(*frameData);
+
+    if (activationReason == arInitial) {
+        FrameRequest init = {};
+        init.decision.n = n;
+        telemetryRequest(&init.times, true);
+        request = requestCreate(d, init);
+        *frameData = request;
+        request->previous = temporalPreviousCreate(d);
+        betterFrameRequestGroup(d, n, 0, request, frameCtx, vsapi);
+    } else if (activationReason == arAllFramesReady) {
+        int64_t start = telemetryReady(d, &request->times);
+        int scored = betterFrameScoreGroup(d, n, 0, request, &start, frameCtx, vsapi);
+        if (scored == 0)
+            return nullptr;
+        VSFrameRef *dst = scored > 0 ? decisionFrame(d, &request->decision, core, vsapi) : nullptr;
+        requestFree(d, request);
+        *frameData = nullptr;
+        return dst;
+    } else if (activationReason == arError) {
+        if (request)
+            requestFree(d, request);
+        *frameData = nullptr;
+    };
+
+    return nullptr;
+};
+
+static void decisionCreate(bfpData *d, VSCore *core, const VSAPI *vsapi) {
+#ifdef BFP_API4
+    VSFilterDependency deps[MAX_VIDEO_INPUT];
+    int numDeps = filterDependencies(d, false, deps);
+    VSVideoInfo vi = d->vi;
+    vsapi->getVideoFormatByID(&vi.format, pfGray8, core);
+    vi.width = 1;
+    vi.height = 1;
+    d->decisionNode = vsapi->createVideoFilter2("FrameDecision", &vi, decisionGetFrame, nullptr, fmParallel, deps, numDeps, d, core);
+#else
+    VSMap *args = vsapi->createMap();
+    VSMap *ret = vsapi->createMap();
+    vsapi->createFilter(args, ret, "FrameDecision", decisionInit, getFrameV3<decisionGetFrame>, nullptr, fmParallel, 0, d, core);
+    d->decisionNode = vsapi->propGetNode(ret, "clip", 0, nullptr);
+    vsapi->freeMap(args);
+    vsapi->freeMap(ret);
+#endif
+};
+
+static const VSFrameRef *VS_CC betterFrameGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    int output;
+    bfpData *d = frameOutput(instanceData, &output, frameCtx, vsapi);
+    if (d->interleave) {
+        output = n % d->numRanks;
+        n /= d->numRanks;
+    }
+    int first = outputFirst(d, output);
+    int needs = outputNeeds(d, output);
+    FrameRequest *request = reinterpret_cast<FrameRequest *>(*frameData);
+
+    if (activationReason == arInitial) {
+        FrameRequest init = {};
+        init.decision.n = n;
+        telemetryRequest(&init.times, true);
+        if (d->prefetch && output == 0) {
+            init.prefetchHint = betterFramePrefetch(d, n, frameCtx, vsapi);
+            init.prefetched = true;
+        }
+        request = requestCreate(d, init);
+        *frameData = request;
+        if (decisionLookup(d, n, &request->decision)) {
+            // The decision is already known, only the picked clips have to be fetched
+            betterFrameFetch(d, n, first, needs, request, frameCtx, vsapi);
+            return nullptr;
+        }
+        if (d->decisionNode) {
+            vsapi->requestFrameFilter(n, d->decisionNode, frameCtx);
+            return nullptr;
+        }
+        request->previous = temporalPreviousCreate(d);
+        betterFrameRequestGroup(d, n, 0, request, frameCtx, vsapi);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *picked[MAX_OUTPUTS] = {};
+        RequestTimes *times = &request->times;
+        int64_t start = telemetryReady(d, times);
+        int64_t winner;
+        if (request->prefetched) {
+            betterFramePrefetchRelease(d, n, request->prefetchHint, frameCtx, vsapi);
+            request->prefetched = false;
+        }
+
+        if (!request->decided && d->decisionNode) {
+            // The decision node scored the frame, now the picked clips are fetched
+            const VSFrameRef *f = vsapi->getFrameFilter(n, d->decisionNode, frameCtx);
+            decisionRead(d, f, &request->decision, vsapi);
+            vsapi->freeFrame(f);
+            telemetryRequest(times, false);
+            betterFrameFetch(d, n, first, needs, request, frameCtx, vsapi);
+            return nullptr;
+        }
+
+        if (request->decided) {
+            // The picked clips' frames, converted to the output format if needed
+            for (int k = first; k < needs; k++)
+                picked[k] = vsapi->getFrameFilter(sourceFrame(d, request->decision.order[k], n), outputNode(d, request->decision.order[k]), frameCtx);
+            VSFrameRef *dst = betterFrameOutput(d, n, output, &request->decision, picked, core, vsapi);
+            winner = request->decision.order[0];
+            telemetryFrame(d, times, start, output ? nullptr : &winner, 1, dst, vsapi);
+            for (int k = first; k < needs; k++)
+                vsapi->freeFrame(picked[k]);
+            requestFree(d, request);
+            *frameData = nullptr;
+            return dst;
+        }
+
+        int scored = betterFrameScoreGroup(d, n, needs, request, &start, frameCtx, vsapi);
+        if (scored < 0) {
+            betterFrameRelease(d, n, request, frameCtx, vsapi);
+            requestFree(d, request);
+            *frameData = nullptr;
+            return nullptr;
+        }
+        if (scored == 0)
+            return nullptr;
+
+        FrameDecision *decision = &request->decision;
+
+        bool converted = false;
+        for (int k = first; k < needs; k++)
+            converted = converted || d->outNode[decision->order[k]];
+        if (converted) {
+            // Only the picked clips are converted to the output format
+            betterFrameRelease(d, n, request, frameCtx, vsapi);
+            telemetryRequest(times, false);
+            betterFrameFetch(d, n, first, needs, request, frameCtx, vsapi);
+            return nullptr;
+        }
+
+        // kept[] is in the same order as the ranking
+        VSFrameRef *dst = betterFrameOutput(d, n, output, decision, request->kept, core, vsapi);
+        winner = decision->order[0];
+        telemetryFrame(d, times, start, output ? nullptr : &winner, 1, dst, vsapi);
+        betterFrameRelease(d, n, request, frameCtx, vsapi);
+        requestFree(d, request);
+        *frameData = nullptr;
+        return dst;
+    } else if (activationReason == arError) {
+        if (request) {
+            betterFrameRelease(d, n, request, frameCtx, vsapi);
+            requestFree(d, request);
+        }
+        *frameData = nullptr;
+    };
+
+    return nullptr;
+};
+
+// State of a Planes or fields request, from the scratch pool.
+static PlanesRequest *planesRequestCreate(bfpData *d) {
+    PlanesRequest *request = new (d->scratch->take(sizeof(PlanesRequest))) PlanesRequest();
+    request->previous = temporalPreviousCreate(d);
+    return request;
+};
+
+static void planesRequestFree(bfpData *d, PlanesRequest *request) {
+    temporalPreviousFree(d, request->previous);
+    d->scratch->give(request, sizeof(PlanesRequest));
+};
+
+// Frame with fields: both fields of every clip are scored on the rows of
+// the source frames, and the output weaves the two winners' fields in one
+// copy. One round of requests, no decision is shared.
+static const VSFrameRef *VS_CC betterFieldsGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    bfpData *d = frameOutput(instanceData, nullptr, frameCtx, vsapi);
     int numInputs = d->numInputs;
+    PlanesRequest *request = reinterpret_cast<PlanesRequest *>(*frameData);
 
     if (activationReason == arInitial) {
+        request = planesRequestCreate(d);
+        *frameData = request;
+        telemetryRequest(&request->times, true);
         for (int i = 0; i < numInputs; i++) {
-            vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+            vsapi->requestFrameFilter(sourceFrame(d, i, n), d->node[i], frameCtx);
+            if (d->temporal)
+                temporalRequest(d, i, n, request->previous, frameCtx, vsapi);
         }
     } else if (activationReason == arAllFramesReady) {
+        RequestTimes *times = &request->times;
+        int64_t start = telemetryReady(d, times);
         const VSFrameRef *src[MAX_VIDEO_INPUT];
-        for (int i = 0; i < numInputs; i++) {
-            src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
-        }
+        for (int i = 0; i < numInputs; i++)
+            src[i] = vsapi->getFrameFilter(sourceFrame(d, i, n), d->node[i], frameCtx);
 
-        int nbest;
-        int dataset[MAX_VIDEO_INPUT];
+        double temporal[MAX_VIDEO_INPUT];
+        uint64_t frozen = 0;
+        if (d->temporal)
+            frozen = temporalScores(d, n, 0, numInputs, src, request->previous, temporal, frameCtx, vsapi);
+
+        int64_t best[2], unique[2], stage[2];
+        double bestNum[2];
+        LogEntry entry;
+        for (int field = 0; field < 2; field++) {
+            double *dataset = entry.scores[field];
+            unique[field] = scoreFrames(d, src, numInputs, &d->score[0], temporal, dataset, vsapi, field);
+            applyTarget(d, dataset, numInputs);
+            best[field] = pickWinner(d, dataset, frozen, numInputs, &stage[field], [d, &src, field, &temporal, vsapi](const int clips[], int count, const ScoreProgram *prog, double scores[]) {
+                const VSFrameRef *close[MAX_VIDEO_INPUT];
+                double closeTemporal[MAX_VIDEO_INPUT];
+                for (int k = 0; k < count; k++) {
+                    close[k] = src[clips[k]];
+                    closeTemporal[k] = temporal[clips[k]];
+                }
+                scoreFrames(d, close, count, prog, closeTemporal, scores, vsapi, field);
+            });
+            bestNum[field] = dataset[best[field]];
+            entry.best[field] = static_cast<int32_t>(best[field]);
+        }
+        if (d->log) {
+            entry.frame = n;
+            d->log->push(entry);
+        }
         for (int i = 0; i < numInputs; i++) {
-            int err;
-            char infoText[100];
-            double fsize = getStats(src[i], d->property, 0, core, vsapi);
-
-            dataset[i] = fsize;
-            if (d->show_info) {
-                VSMap *ret, *args;
-                args = vsapi->createMap();
-                snprintf(infoText, sizeof(infoText), "Video Index Number: %d (%s)", i+1, d->property);
-                vsapi->propSetFrame(args, "clip", src[i], paReplace);
-                vsapi->propSetData(args, "text", infoText, sizeof(infoText), paReplace);
-                ret = vsapi->invoke(
-                    vsapi->getPluginById("com.vapoursynth.text", core),
-                    "Text",
-                    args
-                );
-                src[i] = vsapi->propGetFrame(ret, "clip", 0, &err);
-                vsapi->freeMap(args);
-                vsapi->freeMap(ret);
-            };
+            if (i != best[0] && i != best[1]) {
+                releaseSource(d, i, n, src[i], frameCtx, vsapi);
+                src[i] = nullptr;
+            }
         }
+        start = telemetryScored(d, times, start);
 
-        if (d->property == std::string("max")) {
-            nbest = findMaxIndex(dataset);
-        } else if (d->property == std::string("min")) {
-            nbest = findMinIndex(dataset);
+        // The same clip winning both fields is passed on as is
+        const VSFrameRef *top = src[best[0]], *bottom = src[best[1]];
+        VSFrameRef *dst;
+        if (top == bottom) {
+            dst = vsapi->copyFrame(top, core);
         } else {
-            // Default to Maximum Property
-            nbest = findMaxIndex(dataset);
+            dst = vsapi->newVideoFrame(videoFormat(&d->vi), d->vi.width, d->vi.height, top, core);
+            for (int plane = 0; plane < videoFormat(&d->vi)->numPlanes; plane++)
+                weavePlane(dst, top, bottom, plane, vsapi);
         }
+        VSMap *rwprops = vsapi->getFramePropsRW(dst);
+        vsapi->propSetIntArray(rwprops, "bfpBestIndex", best, 2);
+        vsapi->propSetFloatArray(rwprops, "bfpBestNum", bestNum, 2);
+        vsapi->propSetIntArray(rwprops, "bfpUniqueInputs", unique, 2);
+        if (d->numStages > 1)
+            vsapi->propSetIntArray(rwprops, "bfpCascadeStage", stage, 2);
+        if (d->detectFrozen)
+            vsapi->propSetInt(rwprops, "bfpFrozenMask", static_cast<int64_t>(frozen), paReplace);
+        telemetryFrame(d, times, start, best, 2, dst, vsapi);
+        planesRequestFree(d, request);
+        *frameData = nullptr;
 
-        VSFrameRef *best_frame = vsapi->copyFrame(src[nbest], core);
-        VSMap *rwprops = vsapi->getFramePropsRW(best_frame);
-        vsapi->propSetFloat(rwprops, "bfpBestNum", dataset[nbest], paReplace);
-        vsapi->propSetInt(rwprops, "bfpBestIndex", nbest, paReplace);
-
-        for (int i = 0; i < numInputs; i++) {
-            vsapi->freeFrame(src[i]);
-        }
-        vsapi->freeMap(rwprops);
-        return best_frame;
+        vsapi->freeFrame(top);
+        if (bottom != top)
+            vsapi->freeFrame(bottom);
+        return dst;
+    } else if (activationReason == arError) {
+        planesRequestFree(d, request);
+        *frameData = nullptr;
     };
 
     return nullptr;
 };
 
+// Creates Frame, or Rank when userData names it.
 static void VS_CC betterFrameCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<bfpData> d(new bfpData());
+    const char *function = userData ? static_cast<const char *>(userData) : "Frame";
 
     int err, i;
     d->numInputs = vsapi->propNumElements(in, "clips");
     try {
-        if (d->numInputs > MAX_VIDEO_INPUT) {
-            throw std::runtime_error("maximum of 32 clips are allowed.");
-        };
-        if (d->numInputs < 2) {
-            throw std::runtime_error("please provide 2 or more clips.");
-        };
+        int numGrid = vsapi->propNumElements(in, "grid");
+        loadClips(d.get(), in, numGrid > 0, vsapi);
+        loadAlignment(d.get(), in, core, vsapi);
+        d->selectMin = parseDirection(in, vsapi);
+        parseTarget(d.get(), in, vsapi);
 
-        for (i = 0; i < d->numInputs; i++) {
-            d->node[i] = vsapi->propGetNode(in, "clips", i, &err);
-        };
+        const char *propArg = vsapi->propGetData(in, "prop", 0, &err);
+        if (err)
+            propArg = nullptr;
+        const char *scoreArg = vsapi->propGetData(in, "score", 0, &err);
+        if (err)
+            scoreArg = nullptr;
+        const char *propsArg = vsapi->propGetData(in, "props", 0, &err);
+        if (err)
+            propsArg = "avg";
 
-        const VSVideoInfo *vid[MAX_VIDEO_INPUT];
-        for (i = 0; i < d->numInputs; i++) {
-            if (d->node[i])
-                vid[i] = vsapi->getVideoInfo(d->node[i]);
-        };
+        d->pixelStats = !propArg;
+        if (propArg) {
+            // Scores come straight from the source's own frame props, no pixels are read
+            d->property = propArg;
+        } else {
+            d->property = scoreArg ? std::string(scoreArg) : propsToScore(propsArg);
+            scoreCompile(d->property, &d->score[0]);
+        }
 
-        for (i = 0; i < d->numInputs; i++) {
-            if (vid[0]->format->numPlanes != vid[i]->format->numPlanes
-                || vid[0]->format->subSamplingW != vid[i]->format->subSamplingW
-                || vid[0]->format->subSamplingH != vid[i]->format->subSamplingH
-                || vid[0]->width != vid[i]->width
-                || vid[0]->height != vid[i]->height)
-            {
-                throw std::runtime_error("all inputs must have the same number of planes, dimensions, and also same subsampling.");
-            };
-        };
+        parseCascade(d.get(), in, vsapi);
+        temporalInit(d.get(), d->pixelStats ? 1 : 0, in, vsapi);
+        d->fields = !!vsapi->propGetInt(in, "fields", 0, &err);
 
-        d->vi = *vid[0];
-        const char *props = vsapi->propGetData(in, "props", 0, &err);
+        d->dedup = !!vsapi->propGetInt(in, "dedup", 0, &err);
         if (err) {
-            props = "avg";
+            d->dedup = dedupDefault(&d->score[0]);
+            for (i = 0; i < d->numStages - 1; i++)
+                d->dedup = d->dedup || dedupDefault(&d->cascade[i]);
         }
-        if (props == "max"
-            || props == "maximum"
-            || props == "highest")
-        {
-            props = "PlaneStatsMax";
-        } else if (props == "min"
-                || props == "minimum"
-                || props == "lowest")
-        {
-            props = "PlaneStatsMin";
-        } else if (props == "avg"
-                    || props == "average")
-        {
-            props = "PlaneStatsAverage";
-        } else {
-            throw std::runtime_error(("Unknown props " + std::string(props) + ", must be 'max' or 'min' or 'avg'").c_str());
+
+        d->group = int64ToIntS(vsapi->propGetInt(in, "group", 0, &err));
+        if (err || d->group <= 0 || d->group > d->numInputs)
+            d->group = d->numInputs;
+        if (d->group < d->numInputs && d->pixelStats && (d->score[0].metrics & crossMetrics))
+            throw std::runtime_error("group can't be used with ssim, which compares every clip with all others.");
+        if (d->group < d->numInputs && d->numStages > 1)
+            throw std::runtime_error("group can't be used with cascade, which rescores clips of every group.");
+
+        d->prefetch = int64ToIntS(vsapi->propGetInt(in, "prefetch", 0, &err));
+        if (d->prefetch < 0 || d->prefetch > 16)
+            throw std::runtime_error("prefetch must be between 0 and 16.");
+        d->lastWinner = -1;
+
+        if (numGrid > 0) {
+            // Mismatched clips are scored on a grid and the winner is resized
+            // to the output, which defaults to the first clip's dimensions
+            d->gridWidth = int64ToIntS(vsapi->propGetInt(in, "grid", 0, &err));
+            d->gridHeight = numGrid > 1 ? int64ToIntS(vsapi->propGetInt(in, "grid", 1, &err)) : 0;
+            int width = int64ToIntS(vsapi->propGetInt(in, "width", 0, &err));
+            int height = int64ToIntS(vsapi->propGetInt(in, "height", 0, &err));
+            if (width > 0)
+                d->vi.width = width;
+            if (height > 0)
+                d->vi.height = height;
+            if (d->gridWidth < 1 || d->gridWidth > MAX_GRID_WIDTH)
+                throw std::runtime_error("grid width must be between 1 and " + std::to_string(MAX_GRID_WIDTH) + ".");
+            if (d->gridHeight <= 0)
+                d->gridHeight = static_cast<int>(std::min<int64_t>(std::max<int64_t>(1, static_cast<int64_t>(d->gridWidth) * d->vi.height / d->vi.width), INT_MAX));
+            if (d->gridHeight > MAX_GRID_HEIGHT)
+                throw std::runtime_error("grid height must be between 1 and " + std::to_string(MAX_GRID_HEIGHT) + ".");
+
+            for (i = 0; i < d->numInputs; i++) {
+                const VSVideoInfo *vi = vsapi->getVideoInfo(d->node[i]);
+                if (sameFormat(vi, &d->vi) && vi->width == d->vi.width && vi->height == d->vi.height)
+                    continue;
+                VSMap *args = vsapi->createMap();
+                vsapi->propSetNode(args, "clip", d->node[i], paReplace);
+                vsapi->propSetInt(args, "width", d->vi.width, paReplace);
+                vsapi->propSetInt(args, "height", d->vi.height, paReplace);
+                vsapi->propSetInt(args, "format", formatId(&d->vi, core, vsapi), paReplace);
+                VSMap *ret = vsapi->invoke(
+                    vsapi->getPluginById("com.vapoursynth.resize", core),
+                    "Bicubic",
+                    args
+                );
+                vsapi->freeMap(args);
+                if (vsapi->getError(ret)) {
+                    std::string msg = vsapi->getError(ret);
+                    vsapi->freeMap(ret);
+                    throw std::runtime_error("unable to resize clip " + std::to_string(i) + ": " + msg);
+                }
+                d->outNode[i] = vsapi->propGetNode(ret, "clip", 0, &err);
+                vsapi->freeMap(ret);
+            }
+        }
+
+        const char *scoresIn = vsapi->propGetData(in, "load_scores", 0, &err);
+        if (!err) {
+            ScoreFileHeader expected;
+            scoreHeaderInit(&expected, scoreIndexMagic, d.get(), d->vi.numFrames);
+            d->scoreIndex = scoreFileRead(scoresIn, scoreIndexMagic);
+            scoreHeaderCheck(reinterpret_cast<const ScoreFileHeader *>(d->scoreIndex.data()), &expected, scoresIn);
+            if (reinterpret_cast<const ScoreFileHeader *>(d->scoreIndex.data())->numRecords != d->vi.numFrames)
+                throw std::runtime_error(std::string(scoresIn) + " is truncated or corrupt.");
+        }
+
+        const char *scoresOut = vsapi->propGetData(in, "save_scores", 0, &err);
+        if (!err) {
+            d->scoresOut = scoresOut;
+            d->scoreRecords.resize(scoreRecordSize(d->numInputs) * d->vi.numFrames);
+            d->scoreDone.resize(d->vi.numFrames);
         }
-        d->property = std::string(props);
 
-        for (int i = 0; i < d->numInputs; i++) {
-            VSMap *args, *ret;
-            args = vsapi->createMap();
-            vsapi->propSetNode(args, "clip", d->node[i], paReplace);
-            vsapi->propSetInt(args, "plane", 0, paReplace);
-            ret = vsapi->invoke(
-                vsapi->getPluginById("com.vapoursynth.std", core),
-                "PlaneStats",
-                args
-            );
-            vsapi->freeMap(args);
-            d->node[i] = vsapi->propGetNode(ret, "clip", 0, &err);
-            vsapi->freeMap(ret);
+        d->numOutputs = vsapi->propGetInt(in, "diff", 0, &err) ? 2 : 1;
+        if (userData) {
+            // Rank: every output shares the ranking of a frame
+            d->numRanks = int64ToIntS(vsapi->propGetInt(in, "k", 0, &err));
+            if (err)
+                d->numRanks = std::min(3, d->numInputs);
+            if (d->numRanks < 1 || d->numRanks > d->numInputs)
+                throw std::runtime_error("k must be between 1 and the number of clips.");
+            d->interleave = !!vsapi->propGetInt(in, "interleave", 0, &err);
+            if (d->interleave && d->vi.numFrames > INT_MAX / d->numRanks)
+                throw std::runtime_error("the interleaved clip would be too long.");
+            d->numOutputs = d->interleave ? 1 : d->numRanks;
+        }
+        d->diffAmp = static_cast<float>(vsapi->propGetFloat(in, "diff_amp", 0, &err));
+        if (err)
+            d->diffAmp = 4.0f;
+        if (d->diffAmp <= 0.0f || d->diffAmp >= 256.0f)
+            throw std::runtime_error("diff_amp must be between 0 and 256.");
+        telemetryInit(d.get(), function, in, vsapi);
+        d->scratch.reset(new ScratchPool(&d->telemetry.scratchAllocs));
+        if (d->fields) {
+            // Fields are scored and woven in one round, nothing else fits in it
+            checkFields(&d->vi);
+            if (!d->pixelStats || d->gridWidth || d->group < d->numInputs || d->numOutputs > 1 || d->prefetch || !d->scoresOut.empty() || !d->scoreIndex.empty())
+                throw std::runtime_error("fields can't be used with prop, grid, group, diff, prefetch, save_scores or load_scores.");
         }
 
         if (vsapi->propGetInt(in, "show_info", 0, &err)) {
@@ -211,21 +2444,365 @@ static void VS_CC betterFrameCreate(const VSMap *in, VSMap *out, void *userData,
         } else {
             d->show_info = false;
         }
+        // Last, so a rejected call doesn't truncate an existing log
+        logInit(d.get(), function, d->fields ? 2 : 1, in, core, vsapi);
+
+        if (d->numOutputs > 1 || d->numRanks > 1)
+            decisionCreate(d.get(), core, vsapi);
+
+#ifdef BFP_API4
+        // One filter per output, they share d
+        VSFilterDependency deps[2 * MAX_VIDEO_INPUT + 1];
+        int numDeps = filterDependencies(d.get(), true, deps);
+        VSVideoInfo vi = outputInfo(d.get());
+        VSFilterGetFrame getFrame = d->fields ? betterFieldsGetFrame : betterFrameGetFrame;
+        int numOutputs = d->numOutputs;
+        d->liveOutputs = numOutputs;
+        bfpRegister(d.get());
+        bfpData *shared = d.release();
+        for (int output = 0; output < numOutputs; output++) {
+            VSNodeRef *node = vsapi->createVideoFilter2(function, &vi, getFrame, frameOutputFree, fmParallel, deps, numDeps, new FrameOutput{shared, output}, core);
+            vsapi->mapConsumeNode(out, "clip", node, maAppend);
+        }
+#else
+        VSFilterGetFrame getFrame = d->fields ? getFrameV3<betterFieldsGetFrame> : getFrameV3<betterFrameGetFrame>;
+        vsapi->createFilter(in, out, function, bfpInit, getFrame, bfpFree, fmParallel, 0, d.release(), core);
+#endif
+    } catch (const std::runtime_error &e) {
+        for (i = 0; i < d->numInputs && i < MAX_VIDEO_INPUT; i++) {
+            vsapi->freeNode(d->node[i]);
+            vsapi->freeNode(d->outNode[i]);
+        }
+        vsapi->setError(out, (std::string(function) + ": " + e.what()).c_str());
+    };
+};
+
+
+////////////////////
+// Better Planes //
+////////////////////
+
+static const VSFrameRef *VS_CC betterPlanesGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    bfpData *d = static_cast<bfpData *>(instanceData);
+    int numInputs = d->numInputs;
+    PlanesRequest *request = reinterpret_cast<PlanesRequest *>(*frameData);
+
+    if (activationReason == arInitial) {
+        request = planesRequestCreate(d);
+        *frameData = request;
+        telemetryRequest(&request->times, true);
+        for (int i = 0; i < numInputs; i++) {
+            vsapi->requestFrameFilter(sourceFrame(d, i, n), d->node[i], frameCtx);
+            if (d->temporal)
+                temporalRequest(d, i, n, request->previous, frameCtx, vsapi);
+        }
+    } else if (activationReason == arAllFramesReady) {
+        RequestTimes *times = &request->times;
+        int64_t start = telemetryReady(d, times);
+        const VSFrameRef *src[MAX_VIDEO_INPUT];
+        for (int i = 0; i < numInputs; i++) {
+            src[i] = vsapi->getFrameFilter(sourceFrame(d, i, n), d->node[i], frameCtx);
+        }
+
+        // Alpha is picked like another plane when every clip carries it
+        int numPlanes = d->numPlanes;
+        const VSFrameRef *alpha[MAX_VIDEO_INPUT] = {};
+        bool hasAlpha = true;
+        for (int i = 0; i < numInputs; i++) {
+            int err;
+            alpha[i] = vsapi->propGetFrame(vsapi->getFramePropsRO(src[i]), "_Alpha", 0, &err);
+            hasAlpha = hasAlpha && !err;
+        }
+        // With fields every plane is picked twice, top field first
+        int numFields = d->fields ? 2 : 1;
+        int numPicks = (numPlanes + hasAlpha) * numFields;
+
+        // Measured once on the colour planes, every pick shares it
+        double temporal[MAX_VIDEO_INPUT];
+        uint64_t frozen = 0;
+        if (d->temporal)
+            frozen = temporalScores(d, n, 0, numInputs, src, request->previous, temporal, frameCtx, vsapi);
+
+        const VSFrameRef *dstSet[MAX_PLANES];
+        int64_t nbest[MAX_PICKS];
+        int64_t unique[MAX_PICKS];
+        int64_t stage[MAX_PICKS];
+        bool used[MAX_VIDEO_INPUT] = {};
+        bool woven = false;
+        LogEntry entry;
+        for (int pick = 0; pick < numPicks; pick++) {
+            int plane = pick / numFields;
+            int field = d->fields ? pick % 2 : -1;
+            double *dataset = entry.scores[pick];
+            const VSFrameRef *const *frames = plane < numPlanes ? src : alpha;
+            int framePlane = plane < numPlanes ? plane : 0;
+            unique[pick] = scorePlane(d, frames, numInputs, framePlane, &d->score[plane], temporal, dataset, vsapi, field);
+            applyTarget(d, dataset, numInputs);
+            nbest[pick] = pickWinner(d, dataset, frozen, numInputs, &stage[pick], [d, frames, framePlane, field, &temporal, vsapi](const int clips[], int count, const ScoreProgram *prog, double scores[]) {
+                const VSFrameRef *close[MAX_VIDEO_INPUT];
+                double closeTemporal[MAX_VIDEO_INPUT];
+                for (int k = 0; k < count; k++) {
+                    close[k] = frames[clips[k]];
+                    closeTemporal[k] = temporal[clips[k]];
+                }
+                scorePlane(d, close, count, framePlane, prog, closeTemporal, scores, vsapi, field);
+            });
+            entry.best[pick] = static_cast<int32_t>(nbest[pick]);
+            if (plane < numPlanes) {
+                if (field <= 0)
+                    dstSet[plane] = src[nbest[pick]];
+                used[nbest[pick]] = true;
+                woven = woven || (field == 1 && nbest[pick] != nbest[pick - 1]);
+            }
+        }
+        if (d->log) {
+            entry.frame = n;
+            for (int pick = numPicks; !hasAlpha && pick < numPicks + numFields; pick++) {
+                entry.best[pick] = -1;
+                std::fill(entry.scores[pick], entry.scores[pick] + numInputs, NAN);
+            }
+            d->log->push(entry);
+        }
+        for (int i = 0; i < numInputs; i++) {
+            if (!used[i])
+                releaseSource(d, i, n, src[i], frameCtx, vsapi);
+        }
+        start = telemetryScored(d, times, start);
+
+        // The planes are referenced, not copied, unless a plane's fields come
+        // from different clips and have to be woven
+        VSFrameRef *dstFinal;
+        if (woven) {
+            dstFinal = vsapi->newVideoFrame(videoFormat(&d->vi), d->vi.width, d->vi.height, dstSet[0], core);
+            for (int plane = 0; plane < numPlanes; plane++)
+                weavePlane(dstFinal, src[nbest[plane * 2]], src[nbest[plane * 2 + 1]], plane, vsapi);
+        } else {
+            const int planes[MAX_PLANES] = {0, 1, 2, 3};
+            dstFinal = vsapi->newVideoFrame2(videoFormat(&d->vi), d->vi.width, d->vi.height, dstSet, planes, dstSet[0], core);
+        }
+        VSMap *rwprops = vsapi->getFramePropsRW(dstFinal);
+        if (hasAlpha) {
+            const VSFrameRef *top = alpha[nbest[numPlanes * numFields]];
+            const VSFrameRef *bottom = alpha[nbest[numPicks - 1]];
+            if (top != bottom) {
+                VSFrameRef *wovenAlpha = vsapi->newVideoFrame(vsapi->getFrameFormat(top), vsapi->getFrameWidth(top, 0), vsapi->getFrameHeight(top, 0), top, core);
+                weavePlane(wovenAlpha, top, bottom, 0, vsapi);
+                vsapi->propSetFrame(rwprops, "_Alpha", wovenAlpha, paReplace);
+                vsapi->freeFrame(wovenAlpha);
+            } else {
+                vsapi->propSetFrame(rwprops, "_Alpha", top, paReplace);
+            }
+        }
+        vsapi->propSetIntArray(rwprops, "bfpBestIndex", nbest, numPicks);
+        vsapi->propSetIntArray(rwprops, "bfpUniqueInputs", unique, numPicks);
+        if (d->numStages > 1)
+            vsapi->propSetIntArray(rwprops, "bfpCascadeStage", stage, numPicks);
+        if (d->detectFrozen)
+            vsapi->propSetInt(rwprops, "bfpFrozenMask", static_cast<int64_t>(frozen), paReplace);
+        telemetryFrame(d, times, start, nbest, numPicks, dstFinal, vsapi);
+        planesRequestFree(d, request);
+        *frameData = nullptr;
+
+        for (int i = 0; i < numInputs; i++) {
+            vsapi->freeFrame(alpha[i]);
+            if (used[i])
+                vsapi->freeFrame(src[i]);
+        }
+        return dstFinal;
+    } else if (activationReason == arError) {
+        planesRequestFree(d, request);
+        *frameData = nullptr;
+    };
 
-        vsapi->createFilter(in, out, "Frame", bfpInit, betterFrameGetFrame, bfpFree, fmParallel, 0, d.release(), core);
+    return nullptr;
+};
+
+static void VS_CC betterPlanesCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<bfpData> d(new bfpData());
+
+    int err, i;
+    d->numInputs = vsapi->propNumElements(in, "clips");
+    try {
+        loadClips(d.get(), in, false, vsapi);
+        for (i = 1; i < d->numInputs; i++) {
+            if (!sameFormat(vsapi->getVideoInfo(d->node[i]), &d->vi))
+                throw std::runtime_error("all inputs must have the same format.");
+        };
+        d->numPlanes = videoFormat(&d->vi)->numPlanes;
+        loadAlignment(d.get(), in, core, vsapi);
+        d->selectMin = parseDirection(in, vsapi);
+        parseTarget(d.get(), in, vsapi);
+        d->pixelStats = true;
+        d->fields = !!vsapi->propGetInt(in, "fields", 0, &err);
+        if (d->fields)
+            checkFields(&d->vi);
+
+        // A missing entry repeats the previous plane's, "avg" when none is
+        // given. The entry after the last plane scores the alpha.
+        int numScores = vsapi->propNumElements(in, "score");
+        int numProps = vsapi->propNumElements(in, "props");
+        std::string last = "avg";
+        d->dedup = false;
+        for (int plane = 0; plane <= d->numPlanes; plane++) {
+            if (plane < numScores)
+                last = vsapi->propGetData(in, "score", plane, &err);
+            else if (numScores <= 0 && plane < numProps)
+                last = propsToScore(vsapi->propGetData(in, "props", plane, &err));
+            scoreCompile(last, &d->score[plane]);
+            d->dedup = d->dedup || dedupDefault(&d->score[plane]);
+        }
+        d->property = last;
+
+        parseCascade(d.get(), in, vsapi);
+        temporalInit(d.get(), d->numPlanes + 1, in, vsapi);
+        for (i = 0; i < d->numStages - 1; i++)
+            d->dedup = d->dedup || dedupDefault(&d->cascade[i]);
+
+        int dedup = !!vsapi->propGetInt(in, "dedup", 0, &err);
+        if (!err)
+            d->dedup = dedup;
+        telemetryInit(d.get(), "Planes", in, vsapi);
+        d->scratch.reset(new ScratchPool(&d->telemetry.scratchAllocs));
+        logInit(d.get(), "Planes", (d->numPlanes + 1) * (d->fields ? 2 : 1), in, core, vsapi);
+
+#ifdef BFP_API4
+        VSFilterDependency deps[MAX_VIDEO_INPUT];
+        int numDeps = filterDependencies(d.get(), false, deps);
+        bfpRegister(d.get());
+        vsapi->createVideoFilter(out, "Planes", &d->vi, betterPlanesGetFrame, bfpFree, fmParallel, deps, numDeps, d.get(), core);
+        d.release();
+#else
+        vsapi->createFilter(in, out, "Planes", bfpInit, getFrameV3<betterPlanesGetFrame>, bfpFree, fmParallel, 0, d.release(), core);
+#endif
     } catch (const std::runtime_error &e) {
-        for (i = 0; i < d->numInputs; i++) {
+        for (i = 0; i < d->numInputs && i < MAX_VIDEO_INPUT; i++) {
             vsapi->freeNode(d->node[i]);
         }
-        vsapi->setError(out, ("Frame: " + std::string(e.what())).c_str());
+        vsapi->setError(out, ("Planes: " + std::string(e.what())).c_str());
+    };
+};
+
+
+//////////////////
+// Merge Scores //
+//////////////////
+
+static void VS_CC mergeScoresCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    int err;
+    int numShards = vsapi->propNumElements(in, "shards");
+    const char *output = vsapi->propGetData(in, "output", 0, &err);
+
+    try {
+        if (numShards < 1) {
+            throw std::runtime_error("please provide 1 or more shards.");
+        };
+
+        ScoreFileHeader header;
+        std::vector<uint8_t> records;
+        size_t recSize = 0;
+        int covered = 0;
+
+        for (int s = 0; s < numShards; s++) {
+            std::string path = vsapi->propGetData(in, "shards", s, &err);
+            std::vector<uint8_t> shard = scoreFileRead(path, scoreShardMagic);
+            const ScoreFileHeader *shardHeader = reinterpret_cast<const ScoreFileHeader *>(shard.data());
+
+            if (s == 0) {
+                header = *shardHeader;
+                memcpy(header.magic, scoreIndexMagic, sizeof(header.magic));
+                header.numRecords = header.numFrames;
+                recSize = scoreRecordSize(header.numInputs);
+                records.resize(recSize * header.numFrames);
+                for (int n = 0; n < header.numFrames; n++)
+                    reinterpret_cast<ScoreRecord *>(records.data() + recSize * n)->frame = -1;
+            } else {
+                scoreHeaderCheck(shardHeader, &header, path);
+            }
+
+            const uint8_t *rec = shard.data() + sizeof(ScoreFileHeader);
+            for (int r = 0; r < shardHeader->numRecords; r++, rec += recSize) {
+                int n = reinterpret_cast<const ScoreRecord *>(rec)->frame;
+                if (n < 0 || n >= header.numFrames)
+                    throw std::runtime_error(path + " holds a record for frame " + std::to_string(n) + " which is out of range.");
+                ScoreRecord *dst = reinterpret_cast<ScoreRecord *>(records.data() + recSize * n);
+                if (dst->frame < 0)
+                    covered++;
+                memcpy(dst, rec, recSize);
+            }
+        }
+
+        scoreFileWrite(output, &header, records.data(), records.size());
+        vsapi->propSetInt(out, "frames", covered, paReplace);
+    } catch (const std::runtime_error &e) {
+        vsapi->setError(out, ("MergeScores: " + std::string(e.what())).c_str());
     };
 };
 
 
+///////////
+// Align //
+///////////
+
+static void VS_CC alignCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<bfpData> d(new bfpData());
+
+    int err, i;
+    d->numInputs = vsapi->propNumElements(in, "clips");
+    try {
+        loadClips(d.get(), in, true, vsapi);
+        int radius = int64ToIntS(vsapi->propGetInt(in, "radius", 0, &err));
+        if (err)
+            radius = 10;
+        int numFrames = int64ToIntS(vsapi->propGetInt(in, "frames", 0, &err));
+        if (err)
+            numFrames = 240;
+        const char *cache = vsapi->propGetData(in, "cache", 0, &err);
+        if (radius < 1)
+            throw std::runtime_error("radius must be 1 or more.");
+
+        alignClips(d->node, d->numInputs, radius, numFrames, err ? "" : cache, d->offset, core, vsapi);
+        for (i = 0; i < d->numInputs; i++)
+            vsapi->propSetInt(out, "offsets", d->offset[i], paAppend);
+    } catch (const std::runtime_error &e) {
+        vsapi->setError(out, ("Align: " + std::string(e.what())).c_str());
+    };
+
+    for (i = 0; i < d->numInputs && i < MAX_VIDEO_INPUT; i++) {
+        vsapi->freeNode(d->node[i]);
+    }
+};
+
+
 /////////////////////////////////////////////
 // Init func
 
+static const char frameArgs[] = "clips:" CLIP_ARG "[];props:data:opt;prop:data:opt;score:data:opt;direction:data:opt;grid:int[]:opt;width:int:opt;height:int:opt;align_radius:int:opt;align_frames:int:opt;align_cache:data:opt;dedup:int:opt;diff:int:opt;diff_amp:float:opt;show_info:int:opt;save_scores:data:opt;load_scores:data:opt;telemetry_props:int:opt;log:data:opt;log_format:data:opt;group:int:opt;prefetch:int:opt;target:float:opt;cascade:data[]:opt;margin:float[]:opt;frozen:float:opt;fields:int:opt;";
+static const char planesArgs[] = "clips:" CLIP_ARG "[];props:data[]:opt;score:data[]:opt;direction:data:opt;show_info:int:opt;align_radius:int:opt;align_frames:int:opt;align_cache:data:opt;dedup:int:opt;telemetry_props:int:opt;log:data:opt;log_format:data:opt;target:float:opt;cascade:data[]:opt;margin:float[]:opt;frozen:float:opt;fields:int:opt;";
+static const char rankArgs[] = "clips:" CLIP_ARG "[];k:int:opt;interleave:int:opt;props:data:opt;prop:data:opt;score:data:opt;direction:data:opt;grid:int[]:opt;width:int:opt;height:int:opt;align_radius:int:opt;align_frames:int:opt;align_cache:data:opt;dedup:int:opt;save_scores:data:opt;load_scores:data:opt;telemetry_props:int:opt;log:data:opt;log_format:data:opt;group:int:opt;prefetch:int:opt;target:float:opt;cascade:data[]:opt;margin:float[]:opt;frozen:float:opt;";
+static const char alignArgs[] = "clips:" CLIP_ARG "[];radius:int:opt;frames:int:opt;cache:data:opt;";
+
+#ifdef BFP_API4
+VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
+    vspapi->configPlugin("xyz.n4o.bfp", "bfp", "N4O naive better_frame/better_planes auto-chooser", VS_MAKE_VERSION(1, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
+    vspapi->registerFunction("Frame", frameArgs, "clip:vnode[];", betterFrameCreate, nullptr, plugin);
+    vspapi->registerFunction("Planes", planesArgs, "clip:vnode;", betterPlanesCreate, nullptr, plugin);
+    vspapi->registerFunction("Rank", rankArgs, "clip:vnode[];", betterFrameCreate, const_cast<char *>("Rank"), plugin);
+    vspapi->registerFunction("MergeScores", "shards:data[];output:data;", "frames:int;", mergeScoresCreate, nullptr, plugin);
+    vspapi->registerFunction("Align", alignArgs, "offsets:int[];", alignCreate, nullptr, plugin);
+    vspapi->registerFunction("Telemetry", "", "any", telemetryCreate, nullptr, plugin);
+};
+#else
 void VS_CC bfpInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     configFunc("xyz.n4o.bfp", "bfp", "N4O naive better_frame/better_planes auto-chooser", VAPOURSYNTH_API_VERSION, 1, plugin);
-    registerFunc("Frame", "clips:clip[];props:data:opt;show_info:int:opt;", betterFrameCreate, 0, plugin);
+    registerFunc("Frame", frameArgs, betterFrameCreate, 0, plugin);
+    registerFunc("Planes", planesArgs, betterPlanesCreate, 0, plugin);
+    registerFunc("Rank", rankArgs, betterFrameCreate, const_cast<char *>("Rank"), plugin);
+    registerFunc("MergeScores", "shards:data[];output:data;", mergeScoresCreate, 0, plugin);
+    registerFunc("Align", alignArgs, alignCreate, 0, plugin);
+    registerFunc("Telemetry", "", telemetryCreate, 0, plugin);
+};
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    bfpInitialize(configFunc, registerFunc, plugin);
 };
+#endif
@@ -0,0 +1,880 @@
+/*
+    bfpbench: end-to-end throughput of bfp without a VapourSynth install.
+
+    Implements the part of the VSAPI table bfp uses in-process, feeds it
+    synthetic source clips and drives the getframe functions exactly like the
+    core does (arInitial, then arAllFramesReady until a frame is returned).
+    Every combination of the swept parameters is reported as frames/s, ns per
+    scored pixel, bytes of source planes read per output frame and the
+    scoring and copying time per frame bfp.Telemetry() reports, along with
+    the heap allocations of its scratch pool.
+
+    Build:
+        g++ -O2 -std=c++17 -pthread bfpbench.cpp bfp.cpp -o bfpbench
+
+    Usage:
+        bfpbench [--clips 2,4,8] [--res 1280x720,1920x1080] [--depth 8,10,32]
+                 [--metric avg,sharpness,ssim] [--function Frame] [--frames 200]
+                 [--threads 1] [--hop 1] [--outputs all]
+                 [--family yuv420|rgb|gray] [--alpha 1]
+                 [--duplicates 0] [--lengths 200,100] [--set key=value ...]
+
+    --set passes extra arguments to the function, numbers as int or float
+    and anything else as data, for example --set diff=1. --alpha 1 attaches
+    an _Alpha frame to every source frame. --duplicates N gives the first N
+    clips the same content in separate frames, for checking deduplication.
+    --lengths gives clip i its own frame count, clips past the list get
+    --frames; the output still runs --frames frames. --hop 1 runs every
+    round after arInitial on a new thread, so requests end on another thread
+    than they started on, as they can in the core. --outputs all pulls every
+    output of the function (Rank, diff), all outputs of a frame before the
+    next frame, instead of the first one only.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VapourSynth.h"
+
+#define MOCK_MAX_OUTPUTS 32
+#define MOCK_CACHE_FRAMES 16
+
+void VS_CC bfpInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin);
+
+//////////////////
+// Mock objects //
+//////////////////
+
+typedef struct {
+    char type;
+    int64_t i;
+    double f;
+    std::string s;
+    VSNodeRef *node;
+    const VSFrameRef *frame;
+} MockValue;
+
+struct VSMap {
+    std::map<std::string, std::vector<MockValue>> values;
+    std::string error;
+};
+
+struct VSFrameRef {
+    std::atomic<int> refs;
+    const VSFormat *format;
+    int width[3];
+    int height[3];
+    int stride[3];
+    std::shared_ptr<std::vector<uint8_t>> planes[3];
+    VSMap props;
+};
+
+struct VSNode {
+    VSVideoInfo vi[MOCK_MAX_OUTPUTS];
+    int numOutputs;
+    // Filter nodes
+    VSFilterGetFrame getFrame;
+    VSFilterFree free;
+    void *instanceData;
+    // Source nodes, frame n is pool[n % pool.size()]
+    std::vector<const VSFrameRef *> pool;
+    std::atomic<int> refs;
+    // Like the core, a filter produces a frame once for the requests of it
+    // that overlap and caches the last MOCK_CACHE_FRAMES frames, keyed by
+    // (output, frame)
+    std::mutex cacheLock;
+    std::condition_variable cacheReady;
+    std::set<std::pair<int, int>> producing;
+    std::map<std::pair<int, int>, const VSFrameRef *> cache;
+    std::deque<std::pair<int, int>> cacheOrder;
+};
+
+struct VSNodeRef {
+    VSNode *node;
+    int index;
+};
+
+struct VSFrameContext {
+    int index;
+    std::vector<std::pair<VSNodeRef *, int>> requested;
+    std::vector<std::pair<std::pair<VSNode *, int>, const VSFrameRef *>> ready;
+    std::string error;
+};
+
+struct VSCore {
+    int dummy;
+};
+
+struct VSPlugin {
+    std::map<std::string, std::pair<VSPublicFunction, void *>> functions;
+};
+
+static const VSAPI *api();
+static const VSFrameRef *VS_CC mockCloneFrameRef(const VSFrameRef *f) noexcept;
+static VSNodeRef *VS_CC mockCloneNodeRef(VSNodeRef *node) noexcept;
+static void VS_CC mockClearMap(VSMap *map) noexcept;
+
+// Copies a map, taking new references to the nodes and frames in it.
+static void mockCopyMap(const VSMap *src, VSMap *dst) {
+    dst->values = src->values;
+    for (auto &entry : dst->values) {
+        for (MockValue &v : entry.second) {
+            if (v.type == ptNode)
+                v.node = mockCloneNodeRef(v.node);
+            else if (v.type == ptFrame)
+                v.frame = mockCloneFrameRef(v.frame);
+        }
+    }
+};
+
+static VSFrameRef *mockNewFrame(const VSFormat *format, int width, int height) {
+    VSFrameRef *f = new VSFrameRef();
+    f->refs = 1;
+    f->format = format;
+    for (int p = 0; p < format->numPlanes; p++) {
+        f->width[p] = p ? width >> format->subSamplingW : width;
+        f->height[p] = p ? height >> format->subSamplingH : height;
+        f->stride[p] = (f->width[p] * format->bytesPerSample + 31) & ~31;
+        f->planes[p] = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(f->stride[p]) * f->height[p]);
+    }
+    return f;
+};
+
+static const VSFrameRef *VS_CC mockCloneFrameRef(const VSFrameRef *f) noexcept {
+    const_cast<VSFrameRef *>(f)->refs++;
+    return f;
+};
+
+static void VS_CC mockFreeFrame(const VSFrameRef *f) noexcept {
+    if (f && --const_cast<VSFrameRef *>(f)->refs == 0) {
+        mockClearMap(&const_cast<VSFrameRef *>(f)->props);
+        delete f;
+    }
+};
+
+static VSNodeRef *VS_CC mockCloneNodeRef(VSNodeRef *node) noexcept {
+    node->node->refs++;
+    return new VSNodeRef(*node);
+};
+
+static void VS_CC mockFreeNode(VSNodeRef *ref) noexcept {
+    if (!ref)
+        return;
+    VSNode *node = ref->node;
+    delete ref;
+    if (--node->refs)
+        return;
+    if (node->free)
+        node->free(node->instanceData, nullptr, api());
+    for (const VSFrameRef *f : node->pool)
+        mockFreeFrame(f);
+    for (auto &entry : node->cache)
+        mockFreeFrame(entry.second);
+    delete node;
+};
+
+static VSFrameRef *VS_CC mockNewVideoFrame(const VSFormat *format, int width, int height, const VSFrameRef *propSrc, VSCore *core) noexcept {
+    VSFrameRef *f = mockNewFrame(format, width, height);
+    if (propSrc)
+        mockCopyMap(&propSrc->props, &f->props);
+    return f;
+};
+
+static VSFrameRef *VS_CC mockNewVideoFrame2(const VSFormat *format, int width, int height, const VSFrameRef **planeSrc, const int *planes, const VSFrameRef *propSrc, VSCore *core) noexcept {
+    VSFrameRef *f = mockNewVideoFrame(format, width, height, propSrc, core);
+    for (int p = 0; p < format->numPlanes; p++) {
+        if (planeSrc[p])
+            f->planes[p] = planeSrc[p]->planes[planes[p]];
+    }
+    return f;
+};
+
+// Planes are shared until written, like the core does
+static VSFrameRef *VS_CC mockCopyFrame(const VSFrameRef *src, VSCore *core) noexcept {
+    VSFrameRef *f = new VSFrameRef();
+    f->refs = 1;
+    f->format = src->format;
+    for (int p = 0; p < 3; p++) {
+        f->width[p] = src->width[p];
+        f->height[p] = src->height[p];
+        f->stride[p] = src->stride[p];
+        f->planes[p] = src->planes[p];
+    }
+    mockCopyMap(&src->props, &f->props);
+    return f;
+};
+
+static int VS_CC mockGetStride(const VSFrameRef *f, int plane) noexcept {
+    return f->stride[plane];
+};
+
+static const uint8_t *VS_CC mockGetReadPtr(const VSFrameRef *f, int plane) noexcept {
+    return f->planes[plane]->data();
+};
+
+static uint8_t *VS_CC mockGetWritePtr(VSFrameRef *f, int plane) noexcept {
+    if (f->planes[plane].use_count() > 1)
+        f->planes[plane] = std::make_shared<std::vector<uint8_t>>(*f->planes[plane]);
+    return f->planes[plane]->data();
+};
+
+static const VSFormat *VS_CC mockGetFrameFormat(const VSFrameRef *f) noexcept {
+    return f->format;
+};
+
+static int VS_CC mockGetFrameWidth(const VSFrameRef *f, int plane) noexcept {
+    return f->width[plane];
+};
+
+static int VS_CC mockGetFrameHeight(const VSFrameRef *f, int plane) noexcept {
+    return f->height[plane];
+};
+
+static const VSMap *VS_CC mockGetFramePropsRO(const VSFrameRef *f) noexcept {
+    return &f->props;
+};
+
+static VSMap *VS_CC mockGetFramePropsRW(VSFrameRef *f) noexcept {
+    return &f->props;
+};
+
+//////////
+// Maps //
+//////////
+
+static VSMap *VS_CC mockCreateMap(void) noexcept {
+    return new VSMap();
+};
+
+static void VS_CC mockClearMap(VSMap *map) noexcept {
+    for (auto &entry : map->values) {
+        for (MockValue &v : entry.second) {
+            if (v.type == ptNode)
+                mockFreeNode(v.node);
+            else if (v.type == ptFrame)
+                mockFreeFrame(v.frame);
+        }
+    }
+    map->values.clear();
+};
+
+static void VS_CC mockFreeMap(VSMap *map) noexcept {
+    mockClearMap(map);
+    delete map;
+};
+
+static void VS_CC mockSetError(VSMap *map, const char *errorMessage) noexcept {
+    mockClearMap(map);
+    map->error = errorMessage;
+};
+
+static const char *VS_CC mockGetError(const VSMap *map) noexcept {
+    return map->error.empty() ? nullptr : map->error.c_str();
+};
+
+static int VS_CC mockPropNumElements(const VSMap *map, const char *key) noexcept {
+    auto it = map->values.find(key);
+    return it == map->values.end() ? -1 : static_cast<int>(it->second.size());
+};
+
+static char VS_CC mockPropGetType(const VSMap *map, const char *key) noexcept {
+    auto it = map->values.find(key);
+    return it == map->values.end() ? ptUnset : it->second[0].type;
+};
+
+static const MockValue *mockGet(const VSMap *map, const char *key, int index, char type, int *error) {
+    int dummy;
+    if (!error)
+        error = &dummy;
+    auto it = map->values.find(key);
+    if (it == map->values.end()) {
+        *error = peUnset;
+        return nullptr;
+    }
+    if (index < 0 || index >= static_cast<int>(it->second.size())) {
+        *error = peIndex;
+        return nullptr;
+    }
+    if (it->second[index].type != type) {
+        *error = peType;
+        return nullptr;
+    }
+    *error = 0;
+    return &it->second[index];
+};
+
+static int64_t VS_CC mockPropGetInt(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptInt, error);
+    return v ? v->i : 0;
+};
+
+static double VS_CC mockPropGetFloat(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptFloat, error);
+    return v ? v->f : 0;
+};
+
+static const char *VS_CC mockPropGetData(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptData, error);
+    return v ? v->s.c_str() : nullptr;
+};
+
+static int VS_CC mockPropGetDataSize(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptData, error);
+    return v ? static_cast<int>(v->s.size()) : -1;
+};
+
+static VSNodeRef *VS_CC mockPropGetNode(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptNode, error);
+    return v ? mockCloneNodeRef(v->node) : nullptr;
+};
+
+static const VSFrameRef *VS_CC mockPropGetFrame(const VSMap *map, const char *key, int index, int *error) noexcept {
+    const MockValue *v = mockGet(map, key, index, ptFrame, error);
+    return v ? mockCloneFrameRef(v->frame) : nullptr;
+};
+
+static int VS_CC mockPropDeleteKey(VSMap *map, const char *key) noexcept {
+    auto it = map->values.find(key);
+    if (it == map->values.end())
+        return 0;
+    VSMap removed;
+    removed.values[key] = it->second;
+    map->values.erase(it);
+    mockClearMap(&removed);
+    return 1;
+};
+
+static int mockSet(VSMap *map, const char *key, const MockValue &v, int append) {
+    std::vector<MockValue> &values = map->values[key];
+    if (append == paReplace) {
+        VSMap removed;
+        removed.values[key] = values;
+        mockClearMap(&removed);
+        values.clear();
+    } else if (!values.empty() && values[0].type != v.type) {
+        return 1;
+    }
+    values.push_back(v);
+    return 0;
+};
+
+static int VS_CC mockPropSetInt(VSMap *map, const char *key, int64_t i, int append) noexcept {
+    MockValue v = { ptInt, i, 0, "", nullptr, nullptr };
+    return mockSet(map, key, v, append);
+};
+
+static int VS_CC mockPropSetFloat(VSMap *map, const char *key, double d, int append) noexcept {
+    MockValue v = { ptFloat, 0, d, "", nullptr, nullptr };
+    return mockSet(map, key, v, append);
+};
+
+static int VS_CC mockPropSetData(VSMap *map, const char *key, const char *data, int size, int append) noexcept {
+    MockValue v = { ptData, 0, 0, size < 0 ? std::string(data) : std::string(data, size), nullptr, nullptr };
+    return mockSet(map, key, v, append);
+};
+
+static int VS_CC mockPropSetNode(VSMap *map, const char *key, VSNodeRef *node, int append) noexcept {
+    MockValue v = { ptNode, 0, 0, "", mockCloneNodeRef(node), nullptr };
+    return mockSet(map, key, v, append);
+};
+
+static int VS_CC mockPropSetFrame(VSMap *map, const char *key, const VSFrameRef *f, int append) noexcept {
+    MockValue v = { ptFrame, 0, 0, "", nullptr, mockCloneFrameRef(f) };
+    return mockSet(map, key, v, append);
+};
+
+static int VS_CC mockPropSetIntArray(VSMap *map, const char *key, const int64_t *i, int size) noexcept {
+    mockPropDeleteKey(map, key);
+    for (int k = 0; k < size; k++)
+        mockPropSetInt(map, key, i[k], paAppend);
+    return 0;
+};
+
+static int VS_CC mockPropSetFloatArray(VSMap *map, const char *key, const double *d, int size) noexcept {
+    mockPropDeleteKey(map, key);
+    for (int k = 0; k < size; k++)
+        mockPropSetFloat(map, key, d[k], paAppend);
+    return 0;
+};
+
+/////////////
+// Filters //
+/////////////
+
+static const VSVideoInfo *VS_CC mockGetVideoInfo(VSNodeRef *node) noexcept {
+    return &node->node->vi[node->index];
+};
+
+static void VS_CC mockSetVideoInfo(const VSVideoInfo *vi, int numOutputs, VSNode *node) noexcept {
+    node->numOutputs = std::min(numOutputs, MOCK_MAX_OUTPUTS);
+    for (int i = 0; i < node->numOutputs; i++)
+        node->vi[i] = vi[i];
+};
+
+static void VS_CC mockCreateFilter(const VSMap *in, VSMap *out, const char *name, VSFilterInit init, VSFilterGetFrame getFrame, VSFilterFree free, int filterMode, int flags, void *instanceData, VSCore *core) noexcept {
+    VSNode *node = new VSNode();
+    node->getFrame = getFrame;
+    node->free = free;
+    node->instanceData = instanceData;
+    node->refs = 0;
+    init(const_cast<VSMap *>(in), out, &node->instanceData, node, core, api());
+    for (int i = 0; i < node->numOutputs; i++) {
+        node->refs++;
+        VSNodeRef *ref = new VSNodeRef{ node, i };
+        mockPropSetNode(out, "clip", ref, paAppend);
+        mockFreeNode(ref);
+    }
+};
+
+static void VS_CC mockRequestFrameFilter(int n, VSNodeRef *node, VSFrameContext *frameCtx) noexcept {
+    frameCtx->requested.push_back(std::make_pair(node, n));
+};
+
+static const VSFrameRef *VS_CC mockGetFrameFilter(int n, VSNodeRef *node, VSFrameContext *frameCtx) noexcept {
+    for (auto &r : frameCtx->ready) {
+        if (r.first.first == node->node && r.first.second == n)
+            return mockCloneFrameRef(r.second);
+    }
+    return nullptr;
+};
+
+static void VS_CC mockReleaseFrameEarly(VSNodeRef *node, int n, VSFrameContext *frameCtx) noexcept {
+    for (auto it = frameCtx->ready.begin(); it != frameCtx->ready.end(); ++it) {
+        if (it->first.first == node->node && it->first.second == n) {
+            mockFreeFrame(it->second);
+            frameCtx->ready.erase(it);
+            return;
+        }
+    }
+};
+
+static int VS_CC mockGetOutputIndex(VSFrameContext *frameCtx) noexcept {
+    return frameCtx->index;
+};
+
+static void VS_CC mockSetFilterError(const char *errorMessage, VSFrameContext *frameCtx) noexcept {
+    frameCtx->error = errorMessage;
+};
+
+// Set by --hop: the core runs the rounds of one request on whichever thread
+// is free, the mock moves every round after arInitial to a new thread.
+static bool mockHop = false;
+
+static const VSFrameRef *mockRound(VSNode *node, int n, int activationReason, void **frameData, VSFrameContext *ctx) {
+    if (!mockHop)
+        return node->getFrame(n, activationReason, &node->instanceData, frameData, ctx, nullptr, api());
+    const VSFrameRef *result;
+    std::thread([&] { result = node->getFrame(n, activationReason, &node->instanceData, frameData, ctx, nullptr, api()); }).join();
+    return result;
+};
+
+static const VSFrameRef *mockProduce(VSNodeRef *ref, int n, std::string &error);
+
+// Runs the getframe state machine of a filter to the end.
+static const VSFrameRef *mockRun(VSNodeRef *ref, int n, std::string &error) {
+    VSNode *node = ref->node;
+    VSFrameContext ctx;
+    ctx.index = ref->index;
+    void *frameData = nullptr;
+    const VSFrameRef *result = node->getFrame(n, arInitial, &node->instanceData, &frameData, &ctx, nullptr, api());
+    while (!result && ctx.error.empty() && !ctx.requested.empty()) {
+        std::vector<std::pair<VSNodeRef *, int>> requested;
+        requested.swap(ctx.requested);
+        for (auto &r : requested) {
+            const VSFrameRef *f = mockProduce(r.first, r.second, error);
+            if (!f) {
+                mockRound(node, n, arError, &frameData, &ctx);
+                break;
+            }
+            ctx.ready.push_back(std::make_pair(std::make_pair(r.first->node, r.second), f));
+        }
+        if (!error.empty())
+            break;
+        result = mockRound(node, n, arAllFramesReady, &frameData, &ctx);
+    }
+    for (auto &r : ctx.ready)
+        mockFreeFrame(r.second);
+    if (!ctx.error.empty())
+        error = ctx.error;
+    else if (!result && error.empty())
+        error = "filter returned no frame";
+    return result;
+};
+
+// Produces frame n of a node. A request that overlaps one for the same
+// frame waits for it and shares its frame; after an error it runs again.
+static const VSFrameRef *mockProduce(VSNodeRef *ref, int n, std::string &error) {
+    VSNode *node = ref->node;
+    if (!node->getFrame) {
+        const VSFrameRef *f = node->pool[n % node->pool.size()];
+        return mockCloneFrameRef(f);
+    }
+
+    std::pair<int, int> key(ref->index, n);
+    {
+        std::unique_lock<std::mutex> lock(node->cacheLock);
+        node->cacheReady.wait(lock, [node, &key] { return !node->producing.count(key); });
+        auto it = node->cache.find(key);
+        if (it != node->cache.end())
+            return mockCloneFrameRef(it->second);
+        node->producing.insert(key);
+    }
+    const VSFrameRef *result = mockRun(ref, n, error);
+    {
+        std::lock_guard<std::mutex> lock(node->cacheLock);
+        node->producing.erase(key);
+        if (result) {
+            node->cache[key] = mockCloneFrameRef(result);
+            node->cacheOrder.push_back(key);
+            if (node->cacheOrder.size() > MOCK_CACHE_FRAMES) {
+                mockFreeFrame(node->cache[node->cacheOrder.front()]);
+                node->cache.erase(node->cacheOrder.front());
+                node->cacheOrder.pop_front();
+            }
+        }
+    }
+    node->cacheReady.notify_all();
+    return result;
+};
+
+static const VSFrameRef *VS_CC mockGetFrame(int n, VSNodeRef *node, char *errorMsg, int bufSize) noexcept {
+    std::string error;
+    const VSFrameRef *f = mockProduce(node, n, error);
+    if (!f && errorMsg && bufSize > 0)
+        snprintf(errorMsg, bufSize, "%s", error.c_str());
+    return f;
+};
+
+static const VSFormat *benchFormat(const std::string &family, int depth);
+
+static const VSFormat *VS_CC mockGetFormatPreset(int id, VSCore *core) noexcept {
+    return id == pfGray8 ? benchFormat("gray", 8) : nullptr;
+};
+
+static VSPlugin *VS_CC mockGetPluginById(const char *identifier, VSCore *core) noexcept {
+    return nullptr;
+};
+
+static VSMap *VS_CC mockInvoke(VSPlugin *plugin, const char *name, const VSMap *args) noexcept {
+    VSMap *ret = mockCreateMap();
+    mockSetError(ret, (std::string(name) + " is not available in bfpbench").c_str());
+    return ret;
+};
+
+static void VS_CC mockLogMessage(int msgType, const char *msg) noexcept {
+    fprintf(stderr, "bfp: %s\n", msg);
+};
+
+static const VSAPI *api() {
+    static VSAPI table;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        memset(&table, 0, sizeof(table));
+        table.cloneFrameRef = mockCloneFrameRef;
+        table.cloneNodeRef = mockCloneNodeRef;
+        table.freeFrame = mockFreeFrame;
+        table.freeNode = mockFreeNode;
+        table.newVideoFrame = mockNewVideoFrame;
+        table.copyFrame = mockCopyFrame;
+        table.getPluginById = mockGetPluginById;
+        table.getFormatPreset = mockGetFormatPreset;
+        table.createFilter = mockCreateFilter;
+        table.setError = mockSetError;
+        table.getError = mockGetError;
+        table.setFilterError = mockSetFilterError;
+        table.invoke = mockInvoke;
+        table.getFrame = mockGetFrame;
+        table.getFrameFilter = mockGetFrameFilter;
+        table.requestFrameFilter = mockRequestFrameFilter;
+        table.releaseFrameEarly = mockReleaseFrameEarly;
+        table.getStride = mockGetStride;
+        table.getReadPtr = mockGetReadPtr;
+        table.getWritePtr = mockGetWritePtr;
+        table.createMap = mockCreateMap;
+        table.freeMap = mockFreeMap;
+        table.clearMap = mockClearMap;
+        table.getVideoInfo = mockGetVideoInfo;
+        table.setVideoInfo = mockSetVideoInfo;
+        table.getFrameFormat = mockGetFrameFormat;
+        table.getFrameWidth = mockGetFrameWidth;
+        table.getFrameHeight = mockGetFrameHeight;
+        table.getFramePropsRO = mockGetFramePropsRO;
+        table.getFramePropsRW = mockGetFramePropsRW;
+        table.propNumElements = mockPropNumElements;
+        table.propGetType = mockPropGetType;
+        table.propGetInt = mockPropGetInt;
+        table.propGetFloat = mockPropGetFloat;
+        table.propGetData = mockPropGetData;
+        table.propGetDataSize = mockPropGetDataSize;
+        table.propGetNode = mockPropGetNode;
+        table.propGetFrame = mockPropGetFrame;
+        table.propDeleteKey = mockPropDeleteKey;
+        table.propSetInt = mockPropSetInt;
+        table.propSetFloat = mockPropSetFloat;
+        table.propSetData = mockPropSetData;
+        table.propSetNode = mockPropSetNode;
+        table.propSetFrame = mockPropSetFrame;
+        table.getOutputIndex = mockGetOutputIndex;
+        table.newVideoFrame2 = mockNewVideoFrame2;
+        table.propSetIntArray = mockPropSetIntArray;
+        table.propSetFloatArray = mockPropSetFloatArray;
+        table.logMessage = mockLogMessage;
+    });
+    return &table;
+};
+
+static void VS_CC mockConfigPlugin(const char *identifier, const char *defaultNamespace, const char *name, int apiVersion, int readonly, VSPlugin *plugin) {
+};
+
+static void VS_CC mockRegisterFunction(const char *name, const char *args, VSPublicFunction argsFunc, void *functionData, VSPlugin *plugin) {
+    plugin->functions[name] = std::make_pair(argsFunc, functionData);
+};
+
+///////////////////////
+// Synthetic sources //
+///////////////////////
+
+static const VSFormat *benchFormat(const std::string &family, int depth) {
+    static std::map<std::string, VSFormat> formats;
+    std::string key = family + std::to_string(depth);
+    if (formats.count(key))
+        return &formats[key];
+    VSFormat *f = &formats[key];
+    bool yuv = family == "yuv420";
+    snprintf(f->name, sizeof(f->name), "%s%s%d", yuv ? "YUV420P" : family == "rgb" ? "RGBP" : "Gray", depth == 32 ? "S" : "", depth);
+    f->id = static_cast<int>(1000 * formats.size()) + depth;
+    f->colorFamily = yuv ? cmYUV : family == "rgb" ? cmRGB : cmGray;
+    f->sampleType = depth == 32 ? stFloat : stInteger;
+    f->bitsPerSample = depth;
+    f->bytesPerSample = depth == 8 ? 1 : depth == 32 ? 4 : 2;
+    f->subSamplingW = yuv;
+    f->subSamplingH = yuv;
+    f->numPlanes = f->colorFamily == cmGray ? 1 : 3;
+    return f;
+};
+
+// A source clip cycling through a few pre-generated frames: a gradient with
+// seeded noise, different for every clip so nothing deduplicates.
+static VSNodeRef *benchSource(const VSFormat *format, const VSFormat *alpha, int width, int height, int numFrames, int seed) {
+    VSNode *node = new VSNode();
+    node->refs = 1;
+    node->numOutputs = 1;
+    node->vi[0].format = format;
+    node->vi[0].fpsNum = 24000;
+    node->vi[0].fpsDen = 1001;
+    node->vi[0].width = width;
+    node->vi[0].height = height;
+    node->vi[0].numFrames = numFrames;
+
+    std::mt19937 rng(seed);
+    int peak = format->sampleType == stFloat ? 1 : (1 << format->bitsPerSample) - 1;
+    std::vector<VSFrameRef *> frames;
+    for (int k = 0; k < 4; k++) {
+        frames.push_back(mockNewFrame(format, width, height));
+        if (alpha)
+            frames.push_back(mockNewFrame(alpha, width, height));
+    }
+    VSFrameRef *last = nullptr;
+    for (VSFrameRef *f : frames) {
+        int k = static_cast<int>(node->pool.size());
+        for (int p = 0; p < f->format->numPlanes; p++) {
+            for (int y = 0; y < f->height[p]; y++) {
+                uint8_t *row = f->planes[p]->data() + static_cast<size_t>(f->stride[p]) * y;
+                for (int x = 0; x < f->width[p]; x++) {
+                    double v = (x + y + k * 7) % 256 / 255.0 * 0.8 + (rng() % 1000) / 1000.0 * 0.2;
+                    if (format->sampleType == stFloat)
+                        reinterpret_cast<float *>(row)[x] = static_cast<float>(v);
+                    else if (f->format->bytesPerSample == 1)
+                        row[x] = static_cast<uint8_t>(v * peak);
+                    else
+                        reinterpret_cast<uint16_t *>(row)[x] = static_cast<uint16_t>(v * peak);
+                }
+            }
+        }
+        if (f->format == format) {
+            node->pool.push_back(f);
+            last = f;
+        } else {
+            api()->propSetFrame(&last->props, "_Alpha", f, paReplace);
+            mockFreeFrame(f);
+        }
+    }
+    return new VSNodeRef{ node, 0 };
+};
+
+//////////
+// Main //
+//////////
+
+static std::vector<std::string> splitList(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            out.push_back(item);
+    return out;
+};
+
+int main(int argc, char **argv) {
+    std::vector<std::string> clips = { "2", "4", "8" };
+    std::vector<std::string> resolutions = { "1280x720", "1920x1080", "3840x2160" };
+    std::vector<std::string> depths = { "8", "10", "32" };
+    std::vector<std::string> metrics = { "avg", "sharpness", "ssim" };
+    std::string function = "Frame";
+    std::string family = "yuv420";
+    bool alpha = false;
+    int duplicates = 0;
+    std::vector<std::string> lengths;
+    int numFrames = 100;
+    int threads = 1;
+    bool allOutputs = false;
+    std::vector<std::pair<std::string, std::string>> extra;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string opt = argv[i], val = argv[i + 1];
+        if (opt == "--clips") clips = splitList(val);
+        else if (opt == "--res") resolutions = splitList(val);
+        else if (opt == "--depth") depths = splitList(val);
+        else if (opt == "--metric") metrics = splitList(val);
+        else if (opt == "--function") function = val;
+        else if (opt == "--family") family = val;
+        else if (opt == "--alpha") alpha = atoi(val.c_str()) != 0;
+        else if (opt == "--duplicates") duplicates = atoi(val.c_str());
+        else if (opt == "--lengths") lengths = splitList(val);
+        else if (opt == "--frames") numFrames = atoi(val.c_str());
+        else if (opt == "--threads") threads = std::max(1, atoi(val.c_str()));
+        else if (opt == "--hop") mockHop = atoi(val.c_str()) != 0;
+        else if (opt == "--outputs") allOutputs = val == "all";
+        else if (opt == "--set" && val.find('=') != std::string::npos) extra.push_back(std::make_pair(val.substr(0, val.find('=')), val.substr(val.find('=') + 1)));
+        else {
+            fprintf(stderr, "unknown option %s\n", opt.c_str());
+            return 1;
+        }
+    }
+
+    VSPlugin plugin;
+    bfpInitialize(mockConfigPlugin, mockRegisterFunction, &plugin);
+    if (!plugin.functions.count(function)) {
+        fprintf(stderr, "bfp has no function %s\n", function.c_str());
+        return 1;
+    }
+    const VSAPI *vsapi = api();
+
+    printf("%-8s %6s %-10s %6s %-12s %10s %12s %14s %10s %10s %7s\n", "function", "clips", "res", "depth", "metric", "fps", "ns/pixel", "bytes/frame", "score us", "copy us", "allocs");
+    for (const std::string &clipCount : clips) {
+        for (const std::string &res : resolutions) {
+            for (const std::string &depthStr : depths) {
+                for (const std::string &metric : metrics) {
+                    int numClips = atoi(clipCount.c_str());
+                    int width = 0, height = 0;
+                    sscanf(res.c_str(), "%dx%d", &width, &height);
+                    const VSFormat *format = benchFormat(family, atoi(depthStr.c_str()));
+                    const VSFormat *alphaFormat = alpha ? benchFormat("gray", format->bitsPerSample) : nullptr;
+
+                    VSMap *in = vsapi->createMap();
+                    VSMap *out = vsapi->createMap();
+                    for (int c = 0; c < numClips; c++) {
+                        int clipFrames = c < static_cast<int>(lengths.size()) ? atoi(lengths[c].c_str()) : numFrames;
+                        VSNodeRef *src = benchSource(format, alphaFormat, width, height, clipFrames, c < duplicates ? 1 : c + 1);
+                        vsapi->propSetNode(in, "clips", src, paAppend);
+                        vsapi->freeNode(src);
+                    }
+                    vsapi->propSetData(in, "score", metric.c_str(), -1, paReplace);
+                    for (auto &kv : extra) {
+                        char *end;
+                        long long i = strtoll(kv.second.c_str(), &end, 10);
+                        if (!*end) {
+                            vsapi->propSetInt(in, kv.first.c_str(), i, paAppend);
+                            continue;
+                        }
+                        double f = strtod(kv.second.c_str(), &end);
+                        if (!*end)
+                            vsapi->propSetFloat(in, kv.first.c_str(), f, paAppend);
+                        else
+                            vsapi->propSetData(in, kv.first.c_str(), kv.second.c_str(), -1, paAppend);
+                    }
+                    plugin.functions[function].first(in, out, plugin.functions[function].second, nullptr, vsapi);
+                    if (vsapi->getError(out)) {
+                        fprintf(stderr, "%s\n", vsapi->getError(out));
+                        return 1;
+                    }
+                    std::vector<VSNodeRef *> nodes;
+                    for (int o = 0; o < (allOutputs ? vsapi->propNumElements(out, "clip") : 1); o++)
+                        nodes.push_back(vsapi->propGetNode(out, "clip", o, nullptr));
+                    vsapi->freeMap(in);
+                    vsapi->freeMap(out);
+                    int numOutputs = static_cast<int>(nodes.size());
+
+                    std::atomic<int> next(0);
+                    std::atomic<bool> failed(false);
+                    auto start = std::chrono::steady_clock::now();
+                    std::vector<std::thread> workers;
+                    for (int t = 0; t < threads; t++) {
+                        workers.emplace_back([&] {
+                            char err[256];
+                            // Every output of frame n before frame n + 1
+                            for (int t; (t = next++) < numFrames * numOutputs;) {
+                                int n = t / numOutputs;
+                                const VSFrameRef *f = vsapi->getFrame(n, nodes[t % numOutputs], err, sizeof(err));
+                                if (!f) {
+                                    fprintf(stderr, "frame %d: %s\n", n, err);
+                                    failed = true;
+                                    return;
+                                }
+                                vsapi->freeFrame(f);
+                            }
+                        });
+                    }
+                    for (std::thread &w : workers)
+                        w.join();
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                    // Time split reported by the instance itself
+                    VSMap *telemetry = vsapi->createMap();
+                    plugin.functions["Telemetry"].first(telemetry, telemetry, nullptr, nullptr, vsapi);
+                    int last = vsapi->propNumElements(telemetry, "id") - 1;
+                    double scoreUs = vsapi->propGetInt(telemetry, "score_ns", last, nullptr) / 1000.0 / numFrames;
+                    double copyUs = vsapi->propGetInt(telemetry, "copy_ns", last, nullptr) / 1000.0 / numFrames;
+                    int64_t allocs = vsapi->propGetInt(telemetry, "scratch_allocs", last, nullptr);
+                    vsapi->freeMap(telemetry);
+                    for (VSNodeRef *node : nodes)
+                        vsapi->freeNode(node);
+                    if (failed)
+                        return 1;
+
+                    // Every clip's scored planes are read once per output frame:
+                    // all of them for Planes, the luma or all of RGB for Frame
+                    double planeArea = 1.0;
+                    if (function == "Planes" || format->colorFamily == cmRGB) {
+                        for (int p = 1; p < format->numPlanes; p++)
+                            planeArea += 1.0 / ((1 << format->subSamplingW) * (1 << format->subSamplingH));
+                        planeArea += function == "Planes" && alpha;
+                    }
+                    double pixels = static_cast<double>(width) * height * numClips * planeArea;
+                    double bytes = pixels * format->bytesPerSample;
+                    printf("%-8s %6d %-10s %6d %-12s %10.1f %12.3f %14.0f %10.1f %10.1f %7lld\n", function.c_str(), numClips, res.c_str(),
+                           format->bitsPerSample, metric.c_str(), numFrames / seconds, seconds * 1e9 / (pixels * numFrames), bytes, scoreUs, copyUs, static_cast<long long>(allocs));
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    return 0;
+};
@@ -0,0 +1,1144 @@
+/*
+    Scoring engine shared by bfp.Frame and bfp.Planes.
+
+    Metrics are computed straight from the plane data, only the ones a score
+    expression references are computed and all of them are gathered in one
+    pass over the plane. Every value is normalized so that integer and float
+    clips of any bit depth score on the same 0-1 scale.
+
+    A score expression like "0.7*ssim - 0.3*blockiness + 0.1*avg" is compiled
+    once into a small RPN program, evaluating it needs no allocation.
+
+    Integer kernels have a scalar reference and SSE2/AVX2 variants picked at
+    runtime, all of them sum exactly and must agree bit for bit, see
+    bfpkernelbench.cpp.
+*/
+
+#ifndef BFP_SCORE_H
+#define BFP_SCORE_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BFP_SSE2 1
+#endif
+#if defined(BFP_SSE2) && defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BFP_AVX2 1
+#endif
+
+#ifndef MAX_VIDEO_INPUT
+#define MAX_VIDEO_INPUT 32
+#endif
+#define MAX_SCORE_OPS 64
+#define MAX_SCORE_STACK 16
+#define SSIM_BLOCK 8
+#define BLOCKINESS_GRID 8
+#define MAX_GRID_WIDTH 2048
+#define MAX_GRID_HEIGHT 2048
+#define NOISE_BINS 4096
+#define NOISE_FLOAT_STEPS 1020 // histogram bins per unit of float residual
+#define TEMPORAL_WIDTH 32
+#define TEMPORAL_HEIGHT 18
+#define TEMPORAL_CELLS (TEMPORAL_WIDTH * TEMPORAL_HEIGHT)
+
+typedef enum {
+    mAvg,
+    mMin,
+    mMax,
+    mSharpness,
+    mBlockiness,
+    mSsim,
+    mNoise,
+    mTemporal,
+    metricCount
+} Metric;
+
+static const char *const metricNames[metricCount] = {
+    "avg", "min", "max", "sharpness", "blockiness", "ssim", "noise", "temporal"
+};
+
+// Metrics needing the horizontal and vertical neighbour of every pixel
+static const unsigned gradientMetrics = (1u << mSharpness) | (1u << mBlockiness);
+// Metrics comparing every candidate against the others, not computed per plane
+static const unsigned crossMetrics = (1u << mSsim);
+// Metrics comparing a candidate with its own previous frame, supplied by the
+// caller from summaries it keeps
+static const unsigned temporalMetrics = (1u << mTemporal);
+
+typedef struct {
+    const uint8_t *ptr;
+    ptrdiff_t stride; // in bytes
+    int width;
+    int height;
+    int bytesPerSample;
+    int bitsPerSample;
+    bool isFloat;
+} PlaneView;
+
+/////////////
+// Kernels //
+/////////////
+
+static inline double sampleScale(const PlaneView &p) {
+    return p.isFloat ? 1.0 : 1.0 / ((1 << p.bitsPerSample) - 1);
+};
+
+// Raw sums of one pass over a plane. Integer planes are summed exactly, so
+// every ISA variant of the kernels must produce identical values.
+template <typename acc_t>
+struct PlaneAccumT {
+    acc_t sum;
+    acc_t min;
+    acc_t max;
+    acc_t edge;  // neighbour differences across the BLOCKINESS_GRID lines
+    acc_t inner; // neighbour differences inside grid blocks
+};
+
+typedef PlaneAccumT<int64_t> PlaneAccum;
+typedef PlaneAccumT<double> PlaneAccumFloat;
+
+typedef enum {
+    isaC,
+    isaSSE2,
+    isaAVX2,
+    isaCount
+} KernelIsa;
+
+static const char *const isaNames[isaCount] = { "C", "SSE2", "AVX2" };
+
+// Columns [x0, x1) of one row. A horizontal difference belongs to the grid
+// when x is a multiple of BLOCKINESS_GRID, a vertical one when the row is.
+template <typename T, typename acc_t, bool gradient>
+static inline void rowAccumC(const T *src, const T *prev, int x0, int x1, bool edgeRow, PlaneAccumT<acc_t> &acc) {
+    acc_t sum = 0, edge = 0, inner = 0;
+    acc_t vmin = acc.min, vmax = acc.max;
+    for (int x = x0; x < x1; x++) {
+        T v = src[x];
+        sum += v;
+        vmin = std::min<acc_t>(vmin, v);
+        vmax = std::max<acc_t>(vmax, v);
+        if (gradient) {
+            if (x > 0) {
+                acc_t dx = v > src[x - 1] ? v - src[x - 1] : src[x - 1] - v;
+                if (x % BLOCKINESS_GRID)
+                    inner += dx;
+                else
+                    edge += dx;
+            }
+            if (prev) {
+                acc_t dy = v > prev[x] ? v - prev[x] : prev[x] - v;
+                if (edgeRow)
+                    edge += dy;
+                else
+                    inner += dy;
+            }
+        }
+    }
+    acc.sum += sum;
+    acc.min = vmin;
+    acc.max = vmax;
+    acc.edge += edge;
+    acc.inner += inner;
+};
+
+template <typename T, typename acc_t>
+static inline void accumInit(const PlaneView &p, PlaneAccumT<acc_t> &acc) {
+    acc.sum = acc.edge = acc.inner = 0;
+    acc.min = acc.max = reinterpret_cast<const T *>(p.ptr)[0];
+};
+
+// The scalar reference
+template <typename T, typename acc_t, bool gradient>
+static inline void planeAccumC(const PlaneView &p, PlaneAccumT<acc_t> &acc) {
+    accumInit<T>(p, acc);
+    const T *prev = nullptr;
+    for (int y = 0; y < p.height; y++) {
+        const T *src = reinterpret_cast<const T *>(p.ptr + p.stride * y);
+        rowAccumC<T, acc_t, gradient>(src, prev, 0, p.width, y % BLOCKINESS_GRID == 0, acc);
+        prev = src;
+    }
+};
+
+// The SIMD variants cover columns [BLOCKINESS_GRID, end) of every row with
+// vectors starting on grid columns, so the first lane of every group of
+// BLOCKINESS_GRID lanes is the one across a grid line. The first grid block
+// and the tail are left to rowAccumC.
+#ifdef BFP_SSE2
+static inline int64_t hsum64SSE2(__m128i v) {
+    return _mm_cvtsi128_si64(v) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+};
+
+static inline void planeAccumSSE2_8(const PlaneView &p, bool gradient, PlaneAccum &acc) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i gridLanes = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0);
+    __m128i vsum = zero, vmin = _mm_set1_epi8(-1), vmax = zero;
+    __m128i vdx = zero, vdxEdge = zero, vdyEdge = zero, vdyInner = zero;
+    accumInit<uint8_t>(p, acc);
+
+    const uint8_t *prev = nullptr;
+    for (int y = 0; y < p.height; y++) {
+        const uint8_t *src = p.ptr + p.stride * y;
+        int x = BLOCKINESS_GRID;
+        int end = x + ((p.width - x) / 16) * 16;
+        if (end <= x)
+            end = x = std::min(p.width, BLOCKINESS_GRID);
+        bool edgeRow = y % BLOCKINESS_GRID == 0;
+        gradient ? rowAccumC<uint8_t, int64_t, true>(src, prev, 0, x, edgeRow, acc) : rowAccumC<uint8_t, int64_t, false>(src, prev, 0, x, edgeRow, acc);
+
+        __m128i rowDy = zero;
+        for (; x < end; x += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+            vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+            if (gradient) {
+                __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x - 1));
+                __m128i dx = _mm_or_si128(_mm_subs_epu8(v, left), _mm_subs_epu8(left, v));
+                vdx = _mm_add_epi64(vdx, _mm_sad_epu8(dx, zero));
+                vdxEdge = _mm_add_epi64(vdxEdge, _mm_sad_epu8(_mm_and_si128(dx, gridLanes), zero));
+                if (prev) {
+                    __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + x));
+                    __m128i dy = _mm_or_si128(_mm_subs_epu8(v, up), _mm_subs_epu8(up, v));
+                    rowDy = _mm_add_epi64(rowDy, _mm_sad_epu8(dy, zero));
+                }
+            }
+        }
+        if (edgeRow)
+            vdyEdge = _mm_add_epi64(vdyEdge, rowDy);
+        else
+            vdyInner = _mm_add_epi64(vdyInner, rowDy);
+
+        gradient ? rowAccumC<uint8_t, int64_t, true>(src, prev, end, p.width, edgeRow, acc) : rowAccumC<uint8_t, int64_t, false>(src, prev, end, p.width, edgeRow, acc);
+        prev = src;
+    }
+
+    uint8_t lanes[16];
+    acc.sum += hsum64SSE2(vsum);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), vmin);
+    for (int i = 0; i < 16; i++)
+        acc.min = std::min<int64_t>(acc.min, lanes[i]);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), vmax);
+    for (int i = 0; i < 16; i++)
+        acc.max = std::max<int64_t>(acc.max, lanes[i]);
+    int64_t dxEdge = hsum64SSE2(vdxEdge);
+    acc.edge += dxEdge + hsum64SSE2(vdyEdge);
+    acc.inner += hsum64SSE2(vdx) - dxEdge + hsum64SSE2(vdyInner);
+};
+
+// SSE2 lacks unsigned 16 bit min/max, they run on sign-flipped values
+static inline void planeAccumSSE2_16(const PlaneView &p, bool gradient, PlaneAccum &acc) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i flip = _mm_set1_epi16(-32768);
+    const __m128i gridLanes = _mm_setr_epi16(-1, 0, 0, 0, 0, 0, 0, 0);
+    __m128i vmin = _mm_set1_epi16(32767), vmax = flip;
+    accumInit<uint16_t>(p, acc);
+    int64_t sum = 0, dxAll = 0, dxEdge = 0, dyEdge = 0, dyInner = 0;
+
+    const uint16_t *prev = nullptr;
+    for (int y = 0; y < p.height; y++) {
+        const uint16_t *src = reinterpret_cast<const uint16_t *>(p.ptr + p.stride * y);
+        int x = BLOCKINESS_GRID;
+        int end = x + ((p.width - x) / 8) * 8;
+        if (end <= x)
+            end = x = std::min(p.width, BLOCKINESS_GRID);
+        bool edgeRow = y % BLOCKINESS_GRID == 0;
+        gradient ? rowAccumC<uint16_t, int64_t, true>(src, prev, 0, x, edgeRow, acc) : rowAccumC<uint16_t, int64_t, false>(src, prev, 0, x, edgeRow, acc);
+
+        // 32 bit lanes can't overflow within one row
+        __m128i rowSum = zero, rowDx = zero, rowDxEdge = zero, rowDy = zero;
+        for (; x < end; x += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+            rowSum = _mm_add_epi32(rowSum, _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)));
+            __m128i sv = _mm_xor_si128(v, flip);
+            vmin = _mm_min_epi16(vmin, sv);
+            vmax = _mm_max_epi16(vmax, sv);
+            if (gradient) {
+                __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x - 1));
+                __m128i dx = _mm_or_si128(_mm_subs_epu16(v, left), _mm_subs_epu16(left, v));
+                rowDx = _mm_add_epi32(rowDx, _mm_add_epi32(_mm_unpacklo_epi16(dx, zero), _mm_unpackhi_epi16(dx, zero)));
+                rowDxEdge = _mm_add_epi32(rowDxEdge, _mm_unpacklo_epi16(_mm_and_si128(dx, gridLanes), zero));
+                if (prev) {
+                    __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + x));
+                    __m128i dy = _mm_or_si128(_mm_subs_epu16(v, up), _mm_subs_epu16(up, v));
+                    rowDy = _mm_add_epi32(rowDy, _mm_add_epi32(_mm_unpacklo_epi16(dy, zero), _mm_unpackhi_epi16(dy, zero)));
+                }
+            }
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), rowSum);
+        sum += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        if (gradient) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), rowDx);
+            dxAll += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), rowDxEdge);
+            dxEdge += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), rowDy);
+            (edgeRow ? dyEdge : dyInner) += static_cast<int64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        }
+
+        gradient ? rowAccumC<uint16_t, int64_t, true>(src, prev, end, p.width, edgeRow, acc) : rowAccumC<uint16_t, int64_t, false>(src, prev, end, p.width, edgeRow, acc);
+        prev = src;
+    }
+
+    int16_t lanes[8];
+    acc.sum += sum;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_xor_si128(vmin, flip));
+    for (int i = 0; i < 8; i++)
+        acc.min = std::min<int64_t>(acc.min, static_cast<uint16_t>(lanes[i]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_xor_si128(vmax, flip));
+    for (int i = 0; i < 8; i++)
+        acc.max = std::max<int64_t>(acc.max, static_cast<uint16_t>(lanes[i]));
+    acc.edge += dxEdge + dyEdge;
+    acc.inner += dxAll - dxEdge + dyInner;
+};
+#endif
+
+#ifdef BFP_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static inline int64_t hsum64AVX2(__m256i v) {
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(s) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+};
+
+static inline int64_t hsum32AVX2(__m256i v) {
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), v);
+    int64_t s = 0;
+    for (int i = 0; i < 8; i++)
+        s += lanes[i];
+    return s;
+};
+
+__attribute__((noinline)) static void planeAccumAVX2_8(const PlaneView &p, bool gradient, PlaneAccum &acc) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i gridLanes = _mm256_set1_epi64x(0xFF);
+    __m256i vsum = zero, vmin = _mm256_set1_epi8(-1), vmax = zero;
+    __m256i vdx = zero, vdxEdge = zero, vdyEdge = zero, vdyInner = zero;
+    accumInit<uint8_t>(p, acc);
+
+    const uint8_t *prev = nullptr;
+    for (int y = 0; y < p.height; y++) {
+        const uint8_t *src = p.ptr + p.stride * y;
+        int x = BLOCKINESS_GRID;
+        int end = x + ((p.width - x) / 32) * 32;
+        if (end <= x)
+            end = x = std::min(p.width, BLOCKINESS_GRID);
+        bool edgeRow = y % BLOCKINESS_GRID == 0;
+        gradient ? rowAccumC<uint8_t, int64_t, true>(src, prev, 0, x, edgeRow, acc) : rowAccumC<uint8_t, int64_t, false>(src, prev, 0, x, edgeRow, acc);
+
+        __m256i rowDy = zero;
+        for (; x < end; x += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x));
+            vsum = _mm256_add_epi64(vsum, _mm256_sad_epu8(v, zero));
+            vmin = _mm256_min_epu8(vmin, v);
+            vmax = _mm256_max_epu8(vmax, v);
+            if (gradient) {
+                __m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x - 1));
+                __m256i dx = _mm256_or_si256(_mm256_subs_epu8(v, left), _mm256_subs_epu8(left, v));
+                vdx = _mm256_add_epi64(vdx, _mm256_sad_epu8(dx, zero));
+                vdxEdge = _mm256_add_epi64(vdxEdge, _mm256_and_si256(dx, gridLanes));
+                if (prev) {
+                    __m256i up = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prev + x));
+                    __m256i dy = _mm256_or_si256(_mm256_subs_epu8(v, up), _mm256_subs_epu8(up, v));
+                    rowDy = _mm256_add_epi64(rowDy, _mm256_sad_epu8(dy, zero));
+                }
+            }
+        }
+        if (edgeRow)
+            vdyEdge = _mm256_add_epi64(vdyEdge, rowDy);
+        else
+            vdyInner = _mm256_add_epi64(vdyInner, rowDy);
+
+        gradient ? rowAccumC<uint8_t, int64_t, true>(src, prev, end, p.width, edgeRow, acc) : rowAccumC<uint8_t, int64_t, false>(src, prev, end, p.width, edgeRow, acc);
+        prev = src;
+    }
+
+    uint8_t lanes[32];
+    acc.sum += hsum64AVX2(vsum);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), vmin);
+    for (int i = 0; i < 32; i++)
+        acc.min = std::min<int64_t>(acc.min, lanes[i]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), vmax);
+    for (int i = 0; i < 32; i++)
+        acc.max = std::max<int64_t>(acc.max, lanes[i]);
+    int64_t dxEdge = hsum64AVX2(vdxEdge);
+    acc.edge += dxEdge + hsum64AVX2(vdyEdge);
+    acc.inner += hsum64AVX2(vdx) - dxEdge + hsum64AVX2(vdyInner);
+};
+
+__attribute__((noinline)) static void planeAccumAVX2_16(const PlaneView &p, bool gradient, PlaneAccum &acc) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i gridLanes = _mm256_setr_epi16(-1, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0);
+    __m256i vmin = _mm256_set1_epi16(-1), vmax = zero;
+    accumInit<uint16_t>(p, acc);
+    int64_t sum = 0, dxAll = 0, dxEdge = 0, dyEdge = 0, dyInner = 0;
+
+    const uint16_t *prev = nullptr;
+    for (int y = 0; y < p.height; y++) {
+        const uint16_t *src = reinterpret_cast<const uint16_t *>(p.ptr + p.stride * y);
+        int x = BLOCKINESS_GRID;
+        int end = x + ((p.width - x) / 16) * 16;
+        if (end <= x)
+            end = x = std::min(p.width, BLOCKINESS_GRID);
+        bool edgeRow = y % BLOCKINESS_GRID == 0;
+        gradient ? rowAccumC<uint16_t, int64_t, true>(src, prev, 0, x, edgeRow, acc) : rowAccumC<uint16_t, int64_t, false>(src, prev, 0, x, edgeRow, acc);
+
+        // 32 bit lanes can't overflow within one row
+        __m256i rowSum = zero, rowDx = zero, rowDxEdge = zero, rowDy = zero;
+        for (; x < end; x += 16) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x));
+            rowSum = _mm256_add_epi32(rowSum, _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero), _mm256_unpackhi_epi16(v, zero)));
+            vmin = _mm256_min_epu16(vmin, v);
+            vmax = _mm256_max_epu16(vmax, v);
+            if (gradient) {
+                __m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x - 1));
+                __m256i dx = _mm256_or_si256(_mm256_subs_epu16(v, left), _mm256_subs_epu16(left, v));
+                rowDx = _mm256_add_epi32(rowDx, _mm256_add_epi32(_mm256_unpacklo_epi16(dx, zero), _mm256_unpackhi_epi16(dx, zero)));
+                rowDxEdge = _mm256_add_epi32(rowDxEdge, _mm256_unpacklo_epi16(_mm256_and_si256(dx, gridLanes), zero));
+                if (prev) {
+                    __m256i up = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prev + x));
+                    __m256i dy = _mm256_or_si256(_mm256_subs_epu16(v, up), _mm256_subs_epu16(up, v));
+                    rowDy = _mm256_add_epi32(rowDy, _mm256_add_epi32(_mm256_unpacklo_epi16(dy, zero), _mm256_unpackhi_epi16(dy, zero)));
+                }
+            }
+        }
+        sum += hsum32AVX2(rowSum);
+        if (gradient) {
+            dxAll += hsum32AVX2(rowDx);
+            dxEdge += hsum32AVX2(rowDxEdge);
+            (edgeRow ? dyEdge : dyInner) += hsum32AVX2(rowDy);
+        }
+
+        gradient ? rowAccumC<uint16_t, int64_t, true>(src, prev, end, p.width, edgeRow, acc) : rowAccumC<uint16_t, int64_t, false>(src, prev, end, p.width, edgeRow, acc);
+        prev = src;
+    }
+
+    uint16_t lanes[16];
+    acc.sum += sum;
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), vmin);
+    for (int i = 0; i < 16; i++)
+        acc.min = std::min<int64_t>(acc.min, lanes[i]);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), vmax);
+    for (int i = 0; i < 16; i++)
+        acc.max = std::max<int64_t>(acc.max, lanes[i]);
+    acc.edge += dxEdge + dyEdge;
+    acc.inner += dxAll - dxEdge + dyInner;
+};
+#pragma GCC pop_options
+#endif
+
+// Best variant this CPU runs, detected once.
+static inline int cpuIsa() {
+#if defined(BFP_AVX2)
+    static const int isa = __builtin_cpu_supports("avx2") ? isaAVX2 : isaSSE2;
+    return isa;
+#elif defined(BFP_SSE2)
+    return isaSSE2;
+#else
+    return isaC;
+#endif
+};
+
+// Sums an integer plane with the `isa` variant, false if that variant
+// doesn't exist for this sample size or CPU.
+static inline bool planeAccum(const PlaneView &p, bool gradient, int isa, PlaneAccum &acc) {
+    if (isa > cpuIsa())
+        return false;
+    switch (isa) {
+    case isaC:
+        if (p.bytesPerSample == 1)
+            gradient ? planeAccumC<uint8_t, int64_t, true>(p, acc) : planeAccumC<uint8_t, int64_t, false>(p, acc);
+        else
+            gradient ? planeAccumC<uint16_t, int64_t, true>(p, acc) : planeAccumC<uint16_t, int64_t, false>(p, acc);
+        return true;
+#ifdef BFP_SSE2
+    case isaSSE2:
+        p.bytesPerSample == 1 ? planeAccumSSE2_8(p, gradient, acc) : planeAccumSSE2_16(p, gradient, acc);
+        return true;
+#endif
+#ifdef BFP_AVX2
+    case isaAVX2:
+        p.bytesPerSample == 1 ? planeAccumAVX2_8(p, gradient, acc) : planeAccumAVX2_16(p, gradient, acc);
+        return true;
+#endif
+    }
+    return false;
+};
+
+///////////
+// Noise //
+///////////
+
+// Grain is estimated from the residual of the 3x3 Laplacian
+// [1 -2 1; -2 4 -2; 1 -2 1], which cancels flat areas and linear gradients.
+// Its response to white noise of deviation s has deviation 6s, and the
+// median absolute residual of Gaussian noise is s * 6 / 1.4826, so the
+// median taken from a histogram gives a noise level that edges and
+// details barely move.
+template <typename T, typename res_t>
+static inline res_t noiseResidual(const T *a, const T *b, const T *c, int x) {
+    res_t edge = static_cast<res_t>(a[x - 1]) + a[x + 1] + c[x - 1] + c[x + 1];
+    res_t cross = static_cast<res_t>(a[x]) + c[x] + b[x - 1] + b[x + 1];
+    return edge - 2 * cross + 4 * static_cast<res_t>(b[x]);
+};
+
+// Residual row of an integer plane from column x0 on, |r| >> shift per bin,
+// residuals past the last bin land in it.
+template <typename T>
+static inline void noiseRowC(const T *a, const T *b, const T *c, int x0, int width, int shift, uint32_t hist[NOISE_BINS]) {
+    for (int x = x0; x < width - 1; x++) {
+        int32_t r = noiseResidual<T, int32_t>(a, b, c, x);
+        uint32_t v = static_cast<uint32_t>(r < 0 ? -r : r) >> shift;
+        hist[std::min<uint32_t>(v, NOISE_BINS - 1)]++;
+    }
+};
+
+// Histogram of the absolute residuals of the plane's interior in steps of
+// 1 << shift, the scalar reference.
+template <typename T>
+static inline void noiseHistC(const PlaneView &p, int shift, uint32_t hist[NOISE_BINS]) {
+    for (int y = 1; y < p.height - 1; y++) {
+        const T *a = reinterpret_cast<const T *>(p.ptr + p.stride * (y - 1));
+        const T *b = reinterpret_cast<const T *>(p.ptr + p.stride * y);
+        const T *c = reinterpret_cast<const T *>(p.ptr + p.stride * (y + 1));
+        noiseRowC<T>(a, b, c, 1, p.width, shift, hist);
+    }
+};
+
+// Float residuals are binned in steps of 1 / NOISE_FLOAT_STEPS
+static inline void noiseHistFloat(const PlaneView &p, uint32_t hist[NOISE_BINS]) {
+    for (int y = 1; y < p.height - 1; y++) {
+        const float *a = reinterpret_cast<const float *>(p.ptr + p.stride * (y - 1));
+        const float *b = reinterpret_cast<const float *>(p.ptr + p.stride * y);
+        const float *c = reinterpret_cast<const float *>(p.ptr + p.stride * (y + 1));
+        for (int x = 1; x < p.width - 1; x++) {
+            double r = std::fabs(noiseResidual<float, double>(a, b, c, x));
+            hist[static_cast<int>(std::min(r * NOISE_FLOAT_STEPS, NOISE_BINS - 1.0))]++;
+        }
+    }
+};
+
+#ifdef BFP_SSE2
+// 8 bit residuals fit 16 bit lanes and the histogram (|r| <= 16 * 255)
+static inline void noiseHistSSE2_8(const PlaneView &p, uint32_t hist[NOISE_BINS]) {
+    const __m128i zero = _mm_setzero_si128();
+    uint16_t res[8];
+    for (int y = 1; y < p.height - 1; y++) {
+        const uint8_t *a = p.ptr + p.stride * (y - 1);
+        const uint8_t *b = p.ptr + p.stride * y;
+        const uint8_t *c = p.ptr + p.stride * (y + 1);
+        int x = 1;
+        auto load = [&x, zero](const uint8_t *row, int dx) {
+            return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(row + x + dx)), zero);
+        };
+        for (; x + 8 < p.width; x += 8) {
+            __m128i edge = _mm_add_epi16(_mm_add_epi16(load(a, -1), load(a, 1)), _mm_add_epi16(load(c, -1), load(c, 1)));
+            __m128i cross = _mm_add_epi16(_mm_add_epi16(load(a, 0), load(c, 0)), _mm_add_epi16(load(b, -1), load(b, 1)));
+            __m128i r = _mm_add_epi16(_mm_sub_epi16(edge, _mm_slli_epi16(cross, 1)), _mm_slli_epi16(load(b, 0), 2));
+            r = _mm_max_epi16(r, _mm_sub_epi16(zero, r));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(res), r);
+            for (int k = 0; k < 8; k++)
+                hist[res[k]]++;
+        }
+        noiseRowC<uint8_t>(a, b, c, x, p.width, 0, hist);
+    }
+};
+#endif
+
+// Fills `hist` with the `isa` variant, false if that variant doesn't exist
+// for this sample type or CPU. Integer residuals are binned in steps of
+// 1 << shift.
+static inline bool noiseHist(const PlaneView &p, int isa, uint32_t hist[NOISE_BINS], int shift = 0) {
+    if (isa > cpuIsa())
+        return false;
+    std::fill(hist, hist + NOISE_BINS, 0);
+#ifdef BFP_SSE2
+    // There is no AVX2 variant, SSE2 is reported only as itself
+    if (isa == isaSSE2 && !p.isFloat && p.bytesPerSample == 1 && !shift) {
+        noiseHistSSE2_8(p, hist);
+        return true;
+    }
+#endif
+    if (isa != isaC)
+        return false;
+    if (p.isFloat)
+        noiseHistFloat(p, hist);
+    else if (p.bytesPerSample == 1)
+        noiseHistC<uint8_t>(p, shift, hist);
+    else
+        noiseHistC<uint16_t>(p, shift, hist);
+    return true;
+};
+
+// Noise deviation on the 0-1 scale, 0 for planes without an interior.
+static inline double planeNoise(const PlaneView &p) {
+    if (p.width < 3 || p.height < 3)
+        return 0.0;
+    uint32_t hist[NOISE_BINS];
+    double half = static_cast<double>(p.width - 2) * (p.height - 2) / 2.0;
+    int shift = 0;
+    for (;;) {
+        int isa = cpuIsa();
+        while (!noiseHist(p, isa, hist, shift))
+            isa--;
+        // The median is interpolated linearly inside its bin, the residuals
+        // of a bin being spread evenly over its width
+        uint64_t below = 0;
+        int median = 0;
+        while (median < NOISE_BINS - 1 && below + hist[median] < half)
+            below += hist[median++];
+        double within = hist[median] ? (half - below) / hist[median] : 0.5;
+        if (p.isFloat)
+            return (median + within) / NOISE_FLOAT_STEPS * 1.4826 / 6.0;
+        // Past 8 bits one bin per code value can't hold every residual; a
+        // median in the last bin is measured again in bins wide enough
+        if (median == NOISE_BINS - 1 && !shift && p.bitsPerSample > 8) {
+            shift = p.bitsPerSample - 8;
+            continue;
+        }
+        // Bin m holds the code values [m << shift, (m + 1) << shift), each
+        // one read as the interval of width 1 around it
+        double residual = std::max(0.0, (median + within) * (1 << shift) - 0.5);
+        return residual * sampleScale(p) * 1.4826 / 6.0;
+    }
+};
+
+template <typename acc_t>
+static inline void planeMetricsFinish(const PlaneView &p, bool gradient, const PlaneAccumT<acc_t> &acc, double out[metricCount]) {
+    double scale = sampleScale(p);
+    double pixels = static_cast<double>(p.width) * p.height;
+    out[mAvg] = static_cast<double>(acc.sum) * scale / pixels;
+    out[mMin] = static_cast<double>(acc.min) * scale;
+    out[mMax] = static_cast<double>(acc.max) * scale;
+    if (!gradient)
+        return;
+
+    int64_t w = p.width, h = p.height;
+    int64_t pairs = (w - 1) * h + w * (h - 1);
+    int64_t edgeCount = ((w - 1) / BLOCKINESS_GRID) * h + ((h - 1) / BLOCKINESS_GRID) * w;
+    int64_t innerCount = pairs - edgeCount;
+    out[mSharpness] = pairs ? static_cast<double>(acc.edge + acc.inner) * scale / pairs : 0.0;
+    // Average step across the block grid relative to the average step
+    // inside blocks, 1 means no visible block structure.
+    double edge = edgeCount ? static_cast<double>(acc.edge) / edgeCount : 0.0;
+    double inner = innerCount ? static_cast<double>(acc.inner) / innerCount : 0.0;
+    out[mBlockiness] = (edge + 1e-9) / (inner + 1e-9);
+};
+
+// Computes every metric in `mask` except the cross metrics in one pass,
+// sum/min/max always and the neighbour differences only when a gradient
+// metric was asked for. Noise takes a pass of its own.
+static inline void planeMetrics(const PlaneView &p, unsigned mask, double out[metricCount]) {
+    bool gradient = (mask & gradientMetrics) != 0;
+    if (p.isFloat) {
+        PlaneAccumFloat acc;
+        gradient ? planeAccumC<float, double, true>(p, acc) : planeAccumC<float, double, false>(p, acc);
+        planeMetricsFinish(p, gradient, acc, out);
+    } else {
+        PlaneAccum acc = {};
+        planeAccum(p, gradient, cpuIsa(), acc);
+        planeMetricsFinish(p, gradient, acc, out);
+    }
+    if (mask & (1u << mNoise))
+        out[mNoise] = planeNoise(p);
+};
+
+// Structural similarity of every candidate against the per-pixel mean of all
+// candidates, on non-overlapping SSIM_BLOCK windows. Fixed-size accumulators,
+// no intermediate plane is built. weight[i] is the number of candidates view
+// i stands for, so deduplicated views give the same mean; nullptr means 1
+// each.
+template <typename T>
+static inline void ssimConsensusT(const PlaneView views[], int num, const int weight[], double out[]) {
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    double scale = sampleScale(views[0]);
+    double w[MAX_VIDEO_INPUT];
+    int count = 0;
+    for (int i = 0; i < num; i++) {
+        w[i] = weight ? weight[i] : 1;
+        count += weight ? weight[i] : 1;
+    }
+    double inv = 1.0 / count;
+    int bw = views[0].width / SSIM_BLOCK, bh = views[0].height / SSIM_BLOCK;
+    double total[MAX_VIDEO_INPUT] = {};
+
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            double sx[MAX_VIDEO_INPUT] = {}, sxx[MAX_VIDEO_INPUT] = {}, sxr[MAX_VIDEO_INPUT] = {};
+            double sr = 0, srr = 0;
+            for (int y = by * SSIM_BLOCK; y < (by + 1) * SSIM_BLOCK; y++) {
+                const T *rows[MAX_VIDEO_INPUT];
+                for (int i = 0; i < num; i++)
+                    rows[i] = reinterpret_cast<const T *>(views[i].ptr + views[i].stride * y);
+                for (int x = bx * SSIM_BLOCK; x < (bx + 1) * SSIM_BLOCK; x++) {
+                    double r = 0;
+                    for (int i = 0; i < num; i++)
+                        r += w[i] * rows[i][x];
+                    r *= inv * scale;
+                    sr += r;
+                    srr += r * r;
+                    for (int i = 0; i < num; i++) {
+                        double v = rows[i][x] * scale;
+                        sx[i] += v;
+                        sxx[i] += v * v;
+                        sxr[i] += v * r;
+                    }
+                }
+            }
+            const double n = SSIM_BLOCK * SSIM_BLOCK;
+            double mr = sr / n, vr = srr / n - mr * mr;
+            for (int i = 0; i < num; i++) {
+                double mx = sx[i] / n, vx = sxx[i] / n - mx * mx, cov = sxr[i] / n - mx * mr;
+                total[i] += ((2 * mx * mr + c1) * (2 * cov + c2)) / ((mx * mx + mr * mr + c1) * (vx + vr + c2));
+            }
+        }
+    }
+
+    double blocks = static_cast<double>(bw) * bh;
+    for (int i = 0; i < num; i++)
+        out[i] = blocks ? total[i] / blocks : 1.0;
+};
+
+static inline void ssimConsensus(const PlaneView views[], int num, const int weight[], double out[]) {
+    if (views[0].isFloat)
+        ssimConsensusT<float>(views, num, weight, out);
+    else if (views[0].bytesPerSample == 1)
+        ssimConsensusT<uint8_t>(views, num, weight, out);
+    else
+        ssimConsensusT<uint16_t>(views, num, weight, out);
+};
+
+// 64 bit hash of a plane in the style of xxHash64: four independent lanes
+// over 32 byte stripes, so the loop runs at memory speed. Rows are hashed
+// without their padding and chained, identical planes hash identically
+// regardless of stride.
+static const uint64_t hashPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t hashPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t hashPrime3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t hashRotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+};
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+    return hashRotl(acc + input * hashPrime2, 31) * hashPrime1;
+};
+
+static inline uint64_t hashRow(const uint8_t *p, size_t len, uint64_t seed) {
+    uint64_t v1 = seed + hashPrime1 + hashPrime2, v2 = seed + hashPrime2, v3 = seed, v4 = seed - hashPrime1;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof(w));
+        v1 = hashRound(v1, w[0]);
+        v2 = hashRound(v2, w[1]);
+        v3 = hashRound(v3, w[2]);
+        v4 = hashRound(v4, w[3]);
+    }
+    uint64_t h = hashRotl(v1, 1) + hashRotl(v2, 7) + hashRotl(v3, 12) + hashRotl(v4, 18) + len;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = hashRotl(h ^ hashRound(0, w), 27) * hashPrime1 + hashPrime3;
+    }
+    for (; i < len; i++)
+        h = hashRotl(h ^ (p[i] * hashPrime3), 11) * hashPrime1;
+    h ^= h >> 33;
+    h *= hashPrime2;
+    h ^= h >> 29;
+    return h;
+};
+
+static inline uint64_t planeHash(const PlaneView &p) {
+    uint64_t h = 0;
+    size_t rowBytes = static_cast<size_t>(p.width) * p.bytesPerSample;
+    for (int y = 0; y < p.height; y++)
+        h = hashRow(p.ptr + p.stride * y, rowBytes, h);
+    return h;
+};
+
+// Maps every candidate to the first candidate with identical plane data,
+// dup[i] == i for distinct ones. Planes sharing memory are identical without
+// hashing; the rest are only hashed when `hash` is set, and compared in full
+// when the hashes match. Returns the number of distinct candidates.
+static inline bool sameSampling(const PlaneView &a, const PlaneView &b) {
+    return a.width == b.width && a.height == b.height && a.bytesPerSample == b.bytesPerSample
+        && a.bitsPerSample == b.bitsPerSample && a.isFloat == b.isFloat;
+};
+
+static inline bool planeEqual(const PlaneView &a, const PlaneView &b) {
+    size_t rowBytes = static_cast<size_t>(a.width) * a.bytesPerSample;
+    for (int y = 0; y < a.height; y++) {
+        if (memcmp(a.ptr + a.stride * y, b.ptr + b.stride * y, rowBytes))
+            return false;
+    }
+    return true;
+};
+
+static inline int findDuplicates(const PlaneView views[], int num, bool hash, int dup[]) {
+    uint64_t hashes[MAX_VIDEO_INPUT];
+    bool hashed[MAX_VIDEO_INPUT] = {};
+    int unique = 0;
+    for (int i = 0; i < num; i++) {
+        dup[i] = i;
+        for (int j = 0; j < i && dup[i] == i; j++) {
+            if (dup[j] != j)
+                continue;
+            if (!sameSampling(views[j], views[i]))
+                continue;
+            if (views[j].ptr == views[i].ptr && views[j].stride == views[i].stride) {
+                dup[i] = j;
+            } else if (hash) {
+                for (int k : {i, j}) {
+                    if (!hashed[k]) {
+                        hashes[k] = planeHash(views[k]);
+                        hashed[k] = true;
+                    }
+                }
+                if (hashes[j] == hashes[i] && planeEqual(views[j], views[i]))
+                    dup[i] = j;
+            }
+        }
+        if (dup[i] == i)
+            unique++;
+    }
+    return unique;
+};
+
+// Box-averages a plane onto a gw x gh grid of normalized floats, in a single
+// pass over the source rows. Planes smaller than the grid repeat samples.
+template <typename T>
+static inline void boxDownsampleT(const PlaneView &p, float *dst, int gw, int gh) {
+    double acc[MAX_GRID_WIDTH];
+    int count[MAX_GRID_WIDTH];
+    int xs[MAX_GRID_WIDTH][2];
+    double scale = sampleScale(p);
+    for (int cx = 0; cx < gw; cx++) {
+        xs[cx][0] = static_cast<int>(static_cast<int64_t>(cx) * p.width / gw);
+        xs[cx][1] = std::max(static_cast<int>(static_cast<int64_t>(cx + 1) * p.width / gw), xs[cx][0] + 1);
+    }
+
+    for (int cy = 0; cy < gh; cy++) {
+        int y0 = static_cast<int>(static_cast<int64_t>(cy) * p.height / gh);
+        int y1 = std::max(static_cast<int>(static_cast<int64_t>(cy + 1) * p.height / gh), y0 + 1);
+        std::fill(acc, acc + gw, 0.0);
+        std::fill(count, count + gw, 0);
+        for (int y = y0; y < y1; y++) {
+            const T *src = reinterpret_cast<const T *>(p.ptr + p.stride * y);
+            for (int cx = 0; cx < gw; cx++) {
+                int x0 = xs[cx][0], x1 = xs[cx][1];
+                // Integer samples sum exactly in integers, which vectorize
+                typename std::conditional<std::is_floating_point<T>::value, double, uint64_t>::type sum = 0;
+                for (int x = x0; x < x1; x++)
+                    sum += src[x];
+                acc[cx] += static_cast<double>(sum);
+                count[cx] += x1 - x0;
+            }
+        }
+        for (int cx = 0; cx < gw; cx++)
+            dst[cy * gw + cx] = static_cast<float>(acc[cx] * scale / count[cx]);
+    }
+};
+
+static inline void boxDownsample(const PlaneView &p, float *dst, int gw, int gh) {
+    if (p.isFloat)
+        boxDownsampleT<float>(p, dst, gw, gh);
+    else if (p.bytesPerSample == 1)
+        boxDownsampleT<uint8_t>(p, dst, gw, gh);
+    else
+        boxDownsampleT<uint16_t>(p, dst, gw, gh);
+};
+
+// Mean absolute difference of two summaries of TEMPORAL_CELLS cells.
+static inline double temporalDistance(const float *a, const float *b) {
+    double sum = 0;
+    for (int i = 0; i < TEMPORAL_CELLS; i++)
+        sum += std::fabs(a[i] - b[i]);
+    return sum / TEMPORAL_CELLS;
+};
+
+// Rows of one field of a plane, field 0 being the top one.
+static inline PlaneView fieldView(const PlaneView &p, int field) {
+    PlaneView f = p;
+    f.ptr += p.stride * field;
+    f.stride *= 2;
+    f.height = (p.height - field + 1) / 2;
+    return f;
+};
+
+static inline PlaneView gridView(const float *grid, int gw, int gh) {
+    PlaneView p;
+    p.ptr = reinterpret_cast<const uint8_t *>(grid);
+    p.stride = static_cast<ptrdiff_t>(gw) * sizeof(float);
+    p.width = gw;
+    p.height = gh;
+    p.bytesPerSample = sizeof(float);
+    p.bitsPerSample = 32;
+    p.isFloat = true;
+    return p;
+};
+
+////////////////
+// Difference //
+////////////////
+
+// dst = min(|a - b| * amp, peak). Integer samples use amp in 8.8 fixed point
+// and truncate, so every code path gives the same result.
+template <typename T>
+static inline void diffRowT(const T *a, const T *b, T *dst, int width, int ampQ8, int peak) {
+    for (int x = 0; x < width; x++) {
+        int diff = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+        dst[x] = static_cast<T>(std::min(static_cast<int>((static_cast<int64_t>(diff) * ampQ8) >> 8), peak));
+    }
+};
+
+static inline void diffRowFloat(const float *a, const float *b, float *dst, int width, float amp) {
+    for (int x = 0; x < width; x++)
+        dst[x] = std::fabs(a[x] - b[x]) * amp;
+};
+
+#ifdef BFP_SSE2
+static inline void diffRow8SSE2(const uint8_t *a, const uint8_t *b, uint8_t *dst, int width, int ampQ8) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amp = _mm_set1_epi16(static_cast<short>(ampQ8));
+    const __m128i peak = _mm_set1_epi16(255);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        // (diff << 8) * amp >> 16 == diff * amp >> 8
+        __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, diff), amp);
+        __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, diff), amp);
+        lo = _mm_sub_epi16(lo, _mm_subs_epu16(lo, peak));
+        hi = _mm_sub_epi16(hi, _mm_subs_epu16(hi, peak));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(lo, hi));
+    }
+    diffRowT<uint8_t>(a + x, b + x, dst + x, width - x, ampQ8, 255);
+};
+#endif
+
+// Amplified absolute difference of two planes of the same format with the
+// `isa` variant, false if that variant doesn't exist for this sample type or
+// CPU. amp must be below 256.
+static inline bool diffPlaneWith(const PlaneView &a, const PlaneView &b, uint8_t *dst, ptrdiff_t dstStride, float amp, int isa) {
+    if (isa > cpuIsa())
+        return false;
+#ifdef BFP_SSE2
+    // Only 8-bit integer planes have an SSE2 variant, and none has AVX2
+    if (isa != isaC && !(isa == isaSSE2 && !a.isFloat && a.bytesPerSample == 1))
+        return false;
+#else
+    if (isa != isaC)
+        return false;
+#endif
+    int ampQ8 = static_cast<int>(amp * 256.0f + 0.5f);
+    int peak = a.isFloat ? 0 : (1 << a.bitsPerSample) - 1;
+    for (int y = 0; y < a.height; y++) {
+        const uint8_t *ra = a.ptr + a.stride * y;
+        const uint8_t *rb = b.ptr + b.stride * y;
+        uint8_t *rd = dst + dstStride * y;
+        if (a.isFloat) {
+            diffRowFloat(reinterpret_cast<const float *>(ra), reinterpret_cast<const float *>(rb), reinterpret_cast<float *>(rd), a.width, amp);
+        } else if (a.bytesPerSample == 1) {
+#ifdef BFP_SSE2
+            if (isa == isaSSE2)
+                diffRow8SSE2(ra, rb, rd, a.width, ampQ8);
+            else
+#endif
+                diffRowT<uint8_t>(ra, rb, rd, a.width, ampQ8, peak);
+        } else {
+            diffRowT<uint16_t>(reinterpret_cast<const uint16_t *>(ra), reinterpret_cast<const uint16_t *>(rb), reinterpret_cast<uint16_t *>(rd), a.width, ampQ8, peak);
+        }
+    }
+    return true;
+};
+
+// Same with the fastest variant there is.
+static inline void diffPlane(const PlaneView &a, const PlaneView &b, uint8_t *dst, ptrdiff_t dstStride, float amp) {
+    int isa = cpuIsa();
+    while (!diffPlaneWith(a, b, dst, dstStride, amp, isa))
+        isa--;
+};
+
+///////////////////////
+// Score expressions //
+///////////////////////
+
+typedef enum {
+    opConst,
+    opMetric,
+    opAdd,
+    opSub,
+    opMul,
+    opDiv,
+    opNeg
+} ScoreOpCode;
+
+typedef struct {
+    uint8_t code;
+    uint8_t metric;
+    double value;
+} ScoreOp;
+
+typedef struct {
+    ScoreOp ops[MAX_SCORE_OPS];
+    int numOps;
+    unsigned metrics; // bitmask of Metric values the program reads
+} ScoreProgram;
+
+// Recursive descent over: expr = term {(+|-) term}, term = unary {(*|/) unary},
+// unary = -unary | number | metric | (expr).
+class ScoreParser {
+public:
+    ScoreParser(const std::string &text, ScoreProgram *prog) : s(text), pos(0), nesting(0), prog(prog) {}
+
+    void parse() {
+        prog->numOps = 0;
+        prog->metrics = 0;
+        expr();
+        skipSpace();
+        if (pos != s.size())
+            fail("unexpected '" + s.substr(pos, 1) + "'");
+        int depth = 0, maxDepth = 0;
+        for (int i = 0; i < prog->numOps; i++) {
+            int code = prog->ops[i].code;
+            depth += (code == opConst || code == opMetric) ? 1 : (code == opNeg ? 0 : -1);
+            maxDepth = std::max(maxDepth, depth);
+        }
+        if (maxDepth > MAX_SCORE_STACK)
+            fail("expression is nested too deeply");
+    }
+
+private:
+    const std::string &s;
+    size_t pos;
+    int nesting; // open parentheses and unary minus, bounds the recursion
+    ScoreProgram *prog;
+
+    [[noreturn]] void fail(const std::string &why) {
+        throw std::runtime_error("invalid score expression \"" + s + "\": " + why + ".");
+    }
+
+    void skipSpace() {
+        while (pos < s.size() && isspace(static_cast<unsigned char>(s[pos])))
+            pos++;
+    }
+
+    void emit(uint8_t code, uint8_t metric = 0, double value = 0) {
+        if (prog->numOps == MAX_SCORE_OPS)
+            fail("expression is too long");
+        ScoreOp op = { code, metric, value };
+        prog->ops[prog->numOps++] = op;
+    }
+
+    void expr() {
+        term();
+        for (;;) {
+            skipSpace();
+            if (pos < s.size() && (s[pos] == '+' || s[pos] == '-')) {
+                char c = s[pos++];
+                term();
+                emit(c == '+' ? opAdd : opSub);
+            } else {
+                return;
+            }
+        }
+    }
+
+    void term() {
+        unary();
+        for (;;) {
+            skipSpace();
+            if (pos < s.size() && (s[pos] == '*' || s[pos] == '/')) {
+                char c = s[pos++];
+                unary();
+                emit(c == '*' ? opMul : opDiv);
+            } else {
+                return;
+            }
+        }
+    }
+
+    void unary() {
+        skipSpace();
+        if (pos == s.size())
+            fail("unexpected end");
+        char c = s[pos];
+        if ((c == '-' || c == '(') && ++nesting > MAX_SCORE_OPS)
+            fail("expression is nested too deeply");
+        if (c == '-') {
+            pos++;
+            unary();
+            emit(opNeg);
+            nesting--;
+        } else if (c == '(') {
+            pos++;
+            expr();
+            skipSpace();
+            if (pos == s.size() || s[pos] != ')')
+                fail("missing ')'");
+            pos++;
+            nesting--;
+        } else if (isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            char *end;
+            double v = strtod(s.c_str() + pos, &end);
+            if (end == s.c_str() + pos)
+                fail("bad number");
+            pos = end - s.c_str();
+            emit(opConst, 0, v);
+        } else if (isalpha(static_cast<unsigned char>(c))) {
+            size_t start = pos;
+            while (pos < s.size() && (isalnum(static_cast<unsigned char>(s[pos])) || s[pos] == '_'))
+                pos++;
+            std::string name = s.substr(start, pos - start);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            for (int m = 0; m < metricCount; m++) {
+                if (name == metricNames[m]) {
+                    emit(opMetric, m);
+                    prog->metrics |= 1u << m;
+                    return;
+                }
+            }
+            fail("unknown metric '" + name + "'");
+        } else {
+            fail("unexpected '" + std::string(1, c) + "'");
+        }
+    }
+};
+
+static inline void scoreCompile(const std::string &text, ScoreProgram *prog) {
+    ScoreParser(text, prog).parse();
+};
+
+static inline double scoreEval(const ScoreProgram *prog, const double metrics[metricCount]) {
+    double stack[MAX_SCORE_STACK];
+    int sp = 0;
+    for (int i = 0; i < prog->numOps; i++) {
+        const ScoreOp &op = prog->ops[i];
+        switch (op.code) {
+        case opConst: stack[sp++] = op.value; break;
+        case opMetric: stack[sp++] = metrics[op.metric]; break;
+        case opAdd: sp--; stack[sp - 1] += stack[sp]; break;
+        case opSub: sp--; stack[sp - 1] -= stack[sp]; break;
+        case opMul: sp--; stack[sp - 1] *= stack[sp]; break;
+        case opDiv: sp--; stack[sp - 1] /= stack[sp]; break;
+        case opNeg: stack[sp - 1] = -stack[sp - 1]; break;
+        }
+    }
+    return stack[0];
+};
+
+#endif // BFP_SCORE_H